@@ -0,0 +1,305 @@
+// advise.c ... suggest a choice vector for a query workload
+// part of Multi-attribute linear-hashed files
+// Reads a query log on stdin and prints the ChoiceVector argument for
+//   create that minimises the average # pages the queries read
+// Usage:  ./advise  [-v]  [-p PageSize]  #attrs  #tuples  <  QueryLog
+// where each line of QueryLog is  [Freq]  v1,v2,v3,...
+//	   Freq = how often the query is asked (default 1)
+//	   #tuples = expected size of the relation
+//	   PageSize = as given to create (default 1K)
+// -v shows the file size assumed and the cost of each query
+// Assumes the default count split policy, under which a bucket
+//   averages about one page, so pages read ~ candidate buckets
+
+#include "defs.h"
+#include "query.h"
+#include "chvec.h"
+#include "hash.h"
+
+#define USAGE "./advise  [-v]  [-p PageSize]  #attrs  #tuples  <  QueryLog"
+#define MAXATTRS 10
+
+// one logged query: its weight, which attributes it knows, and
+//   the hashes of their values
+
+typedef struct {
+	double weight;
+	Bits   knows;           // bit a set if attribute a is known
+	Bits   hash[MAXATTRS];  // hash of each known value
+	char  *text;
+} LogQuery;
+
+static LogQuery *queries = NULL;
+static int nqueries = 0;
+static int natts;
+static Count filedepth, filesp;  // depth d and split pointer at #tuples
+static double pw[1 << MAXATTRS];  // total weight of each knows pattern
+
+// add one line of the log; FALSE if it's not a valid query
+
+static Bool addQuery(char *line)
+{
+	static int max = 0;
+	char *c = line;
+	double w = 1;
+	while (*c == ' ' || *c == '\t') c++;
+	char *sp = strpbrk(c, " \t");
+	if (sp != NULL) {
+		char *end;
+		w = strtod(c, &end);
+		if (end != sp || w <= 0) return FALSE;
+		c = sp;
+		while (*c == ' ' || *c == '\t') c++;
+	}
+	if (nqueries == max) {
+		max = (max == 0) ? 1024 : 2*max;
+		queries = realloc(queries, max*sizeof(LogQuery));
+		assert(queries != NULL);
+	}
+	LogQuery *q = &queries[nqueries];
+	q->weight = w;
+	q->knows = 0;
+	q->text = copyString(c);
+	int a = 0;
+	char *c0 = c;
+	for (;;) {
+		while (*c != ',' && *c != '\0') c++;
+		if (a >= natts || c == c0) return FALSE;
+		if (!(c-c0 == 1 && *c0 == '?')) {
+			q->knows |= (1u << a);
+			q->hash[a] = hash_any((unsigned char *)c0, c-c0);
+		}
+		a++;
+		if (*c == '\0') break;
+		c++; c0 = c;
+	}
+	if (a != natts) return FALSE;
+	pw[q->knows] += w;
+	nqueries++;
+	return TRUE;
+}
+
+// expected buckets read by the logged queries, on average, if attribute
+//   a gives m[a] of the lower d hash bits and attribute top gives
+//   bit d, which the buckets below the split pointer also use
+
+static double expectedCost(Count *m, int top)
+{
+	double total = 0, weight = 0;
+	Bits k;
+	int a;
+	for (k = 0; k < (1u << natts); k++) {
+		if (pw[k] == 0) continue;
+		Count nfree = 0;
+		for (a = 0; a < natts; a++)
+			if (!(k & (1u << a))) nfree += m[a];
+		double cost = (double)(1u << nfree);
+		if (!(k & (1u << top)))
+			cost *= 1 + (double)filesp/(1u << filedepth);
+		total += pw[k]*cost;
+		weight += pw[k];
+	}
+	return total/weight;
+}
+
+// the best attribute to give bit d, for lower bits m
+// the split pointer is taken as at least 1, so that the choice
+//   still favours often-known attributes when sp = 0
+
+static int bestTop(Count *m, double *cost)
+{
+	Count sp = filesp;
+	int a, best = 0;
+	if (filesp == 0) filesp = 1;
+	for (a = 0; a < natts; a++) {
+		double c = expectedCost(m, a);
+		if (a == 0 || c < *cost) { *cost = c; best = a; }
+	}
+	filesp = sp;
+	return best;
+}
+
+// share the lower d bits among the attributes
+// each bit goes greedily to the attribute that lowers the cost most,
+//   then single bits are moved between attributes while that helps
+
+static int chooseBits(Count *m)
+{
+	double cost, c;
+	int a, b, i;
+	for (a = 0; a < natts; a++) m[a] = 0;
+	for (i = 0; i < filedepth; i++) {
+		int best = 0;
+		for (a = 0; a < natts; a++) {
+			m[a]++;
+			bestTop(m, &c);
+			if (a == 0 || c < cost) { cost = c; best = a; }
+			m[a]--;
+		}
+		m[best]++;
+	}
+	int top = bestTop(m, &cost);
+	Bool moved = TRUE;
+	while (moved) {
+		moved = FALSE;
+		for (a = 0; a < natts; a++) {
+			for (b = 0; b < natts && m[a] > 0; b++) {
+				if (a == b) continue;
+				m[a]--; m[b]++;
+				int t = bestTop(m, &c);
+				if (c < cost - 1e-9) {
+					cost = c; top = t; moved = TRUE;
+				}
+				else {
+					m[a]++; m[b]--;
+				}
+			}
+		}
+	}
+	return top;
+}
+
+// lay out the chosen bits as a choice vector
+// positions 0..d-1 are ordered so that each prefix is as cheap
+//   as possible, in case the file is smaller than expected
+// remaining positions are filled from the top bit of each attribute
+//   down, as parseChVec() does
+
+static void buildChVec(Count *m, int top, ChVec cv)
+{
+	Count used[MAXATTRS], next[MAXATTRS], pre[MAXATTRS];
+	int a, i;
+	double cost, c;
+	for (a = 0; a < natts; a++) { used[a] = 0; pre[a] = 0; next[a] = 31; }
+	Count save = filedepth, sp = filesp;
+	filesp = 0;
+	for (i = 0; i < save; i++) {
+		int best = -1;
+		filedepth = i+1;
+		for (a = 0; a < natts; a++) {
+			if (used[a] == m[a]) continue;
+			pre[a]++;
+			c = expectedCost(pre, 0);
+			if (best < 0 || c < cost) { cost = c; best = a; }
+			pre[a]--;
+		}
+		pre[best]++;
+		cv[i].att = best; cv[i].bit = used[best]++;
+	}
+	filedepth = save; filesp = sp;
+	cv[i].att = top; cv[i].bit = used[top]++;
+	for (a = 0, i++; i < MAXCHVEC; i++, a = (a+1) % natts) {
+		cv[i].att = a; cv[i].bit = next[a]--;
+	}
+}
+
+// the choice vector create gives when the argument is empty
+
+static void defaultChVec(ChVec cv)
+{
+	Count next[MAXATTRS];
+	int a, i;
+	for (a = 0; a < natts; a++) next[a] = 31;
+	for (a = 0, i = 0; i < MAXCHVEC; i++, a = (a+1) % natts) {
+		cv[i].att = a; cv[i].bit = next[a]--;
+	}
+}
+
+// buckets read by logged query q under a choice vector, found
+//   from the query's actual values, as a Query would
+
+static Count queryCost(ChVecMap *map, LogQuery *q)
+{
+	Bits known = 0, unknown = 0;
+	int a;
+	for (a = 0; a < natts; a++) {
+		if (q->knows & (1u << a))
+			known |= chvecApply(&map[a], q->hash[a]);
+		else
+			unknown |= map[a].mask;
+	}
+	return candidateCount(known, unknown, filedepth, filesp);
+}
+
+// Main ... process args, read log, search
+
+int main(int argc, char **argv)
+{
+	char err[2*MAXERRMSG];  // buffer for error messages
+	char line[MAXTUPLEN+20];  // one line of the log
+	int verbose = 0;  // show costs as well
+	int pagesize = PAGESIZE;  // bytes per page
+	long ntups;  // expected # tuples
+
+	int a = 1;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-p") == 0 && a+1 < argc) {
+			if ((pagesize = parsePageSize(argv[++a])) == 0)
+				fatal(USAGE);
+		}
+		else
+			fatal(USAGE);
+		a++;
+	}
+	if (argc - a != 2) fatal(USAGE);
+	natts = atoi(argv[a]);
+	ntups = atol(argv[a+1]);
+	if (natts < 2 || natts > MAXATTRS) {
+		sprintf(err, "Invalid #attrs: %d (must be 1 < # < 11)", natts);
+		fatal(err);
+	}
+	if (ntups < 1) fatal(USAGE);
+
+	// from one bucket, a bucket is added every pagesize/(10*#attrs) inserts
+	long nb = 1 + ntups / (pagesize/(10*natts));
+	if (nb > (1L << 30)) nb = 1L << 30;
+	for (filedepth = 0; (2L << filedepth) <= nb; filedepth++) /*skip*/;
+	filesp = nb - (1L << filedepth);
+
+	int lineno = 0;
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0') continue;
+		if (!addQuery(line)) {
+			sprintf(err, "Invalid query on line %d: %s", lineno, line);
+			fatal(err);
+		}
+	}
+	if (nqueries == 0) fatal("No queries in log");
+
+	Count m[MAXATTRS];
+	ChVec best, dflt;
+	int top = chooseBits(m);
+	buildChVec(m, top, best);
+	defaultChVec(dflt);
+
+	if (verbose) {
+		printf("%ld tuples -> %ld buckets, depth=%d, sp=%d\n", ntups, nb,
+		       filedepth, filesp);
+		ChVecMap *bmap = compileChVec(best, natts);
+		ChVecMap *dmap = compileChVec(dflt, natts);
+		double bsum = 0, dsum = 0, wsum = 0;
+		int i;
+		printf("%10s %10s %10s  %s\n", "weight", "advised", "default", "query");
+		for (i = 0; i < nqueries; i++) {
+			LogQuery *q = &queries[i];
+			Count bc = queryCost(bmap, q), dc = queryCost(dmap, q);
+			printf("%10g %10d %10d  %s\n", q->weight, bc, dc, q->text);
+			bsum += q->weight*bc; dsum += q->weight*dc; wsum += q->weight;
+		}
+		printf("average pages/query: advised %.1f, default %.1f\n",
+		       bsum/wsum, dsum/wsum);
+		free(bmap); free(dmap);
+	}
+
+	// the bits the file uses, plus the next one for it to grow into
+	int i;
+	for (i = 0; i <= filedepth; i++) {
+		printf("%d,%d", best[i].att, best[i].bit);
+		putchar(i < filedepth ? ':' : '\n');
+	}
+	return 0;
+}
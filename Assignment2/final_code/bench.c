@@ -0,0 +1,308 @@
+// bench.c ... performance measurements
+// part of Multi-attribute linear-hashed files
+// Reads tuples (e.g. from gendata) on stdin and times operations on them
+// Usage:  ./gendata 100000 4 | ./bench  Test  [#reps]
+// where Test is one of
+//   pagesize = insert/query throughput for a range of page sizes
+//   match = tupleMatch() against compiled predicates
+//   split = cost of splitting a bucket, by overflow chain length
+//   wal = logged insert throughput, by group commit window
+// #reps is # queries per test (default 1000), or # splits timed
+//   per chain length for split (default 20), or # inserts per
+//   window for wal (default 10000)
+
+#include <time.h>
+#include <unistd.h>
+#include "bits.h"
+#include "defs.h"
+#include "reln.h"
+#include "query.h"
+#include "tuple.h"
+
+#define USAGE "./bench  pagesize|match|split|wal  [#reps]"
+#define BENCHREL "bench_R"
+
+// input tuples, read once and shared by all tests
+
+static char **tuples = NULL;
+static int ntuples = 0;
+static int natts = 0;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void readInput()
+{
+	char line[MAXTUPLEN];
+	int max = 1024;
+	tuples = malloc(max*sizeof(char *));
+	assert(tuples != NULL);
+	while (fgets(line, MAXTUPLEN, stdin) != NULL) {
+		line[strcspn(line,"\n")] = '\0';
+		if (line[0] == '\0') continue;
+		if (ntuples == max) {
+			max *= 2;
+			tuples = realloc(tuples, max*sizeof(char *));
+			assert(tuples != NULL);
+		}
+		tuples[ntuples++] = copyString(line);
+	}
+	if (ntuples == 0) fatal("No input tuples");
+	char *c;
+	natts = 1;
+	for (c = tuples[0]; *c != '\0'; c++)
+		if (*c == ',') natts++;
+}
+
+static void dropRelation(char *name)
+{
+	char fname[MAXFILENAME];
+	sprintf(fname,"%s.info",name); unlink(fname);
+	sprintf(fname,"%s.data",name); unlink(fname);
+	sprintf(fname,"%s.ovflow",name); unlink(fname);
+	sprintf(fname,"%s.wal",name); unlink(fname);
+}
+
+// make a query from tuple t, keeping only attribute a
+
+static void makeQuery(char *t, int a, char *q)
+{
+	int i = 0;
+	char *c = t;
+	for (;;) {
+		if (i == a) {
+			while (*c != ',' && *c != '\0') *q++ = *c++;
+		}
+		else {
+			*q++ = '?';
+			while (*c != ',' && *c != '\0') c++;
+		}
+		if (*c == '\0') break;
+		*q++ = *c++;
+		i++;
+	}
+	*q = '\0';
+}
+
+// run nq queries on attribute a; return #matches
+
+static int runQueries(Reln r, int nq, int a)
+{
+	int i, nfound = 0;
+	char qstr[MAXTUPLEN];
+	for (i = 0; i < nq; i++) {
+		makeQuery(tuples[rand() % ntuples], a, qstr);
+		Query q = startQuery(r, qstr);
+		Match m;
+		while (nextMatch(q, &m)) nfound++;
+		closeQuery(q);
+	}
+	return nfound;
+}
+
+// compare insert and query throughput across page sizes
+
+static void benchPageSize(int nq)
+{
+	if (nq == 0) nq = 1000;
+	Count sizes[] = { 1024, 4096, 8192, 16384, 65536 };
+	int i, j, nsizes = sizeof(sizes)/sizeof(sizes[0]);
+
+	printf("%d tuples, %d attrs, %d queries per test\n", ntuples, natts, nq);
+	printf("%-8s %8s %8s %12s %12s %12s\n", "pagesize", "#pages",
+	       "#ovflow", "inserts/s", "id-query/s", "attr-query/s");
+	for (i = 0; i < nsizes; i++) {
+		dropRelation(BENCHREL);
+		if (newRelation(BENCHREL, natts, 2, 1, "", sizes[i],
+		                SPLIT_COUNT, 0) != OK)
+			fatal("Can't create benchmark relation");
+
+		Reln r = openRelation(BENCHREL, "r+");
+		double t0 = now();
+		for (j = 0; j < ntuples; j++) {
+			Tuple t = copyString(tuples[j]);
+			if (addToRelation(r, t) == NO_PAGE) fatal("Insert failed");
+			free(t);
+		}
+		closeRelation(r);
+		double tins = now() - t0;
+
+		r = openRelation(BENCHREL, "r");
+		srand(1);
+		t0 = now();
+		runQueries(r, nq, 0);
+		double tid = now() - t0;
+		t0 = now();
+		runQueries(r, nq, 1);
+		double tattr = now() - t0;
+
+		char fname[MAXFILENAME];
+		sprintf(fname, "%s.ovflow", BENCHREL);
+		FILE *f = fopen(fname, "r");
+		fseek(f, 0, SEEK_END);
+		long novflow = ftell(f) / sizes[i];
+		fclose(f);
+
+		printf("%-8d %8d %8ld %12.0f %12.0f %12.0f\n", sizes[i], npages(r),
+		       novflow, ntuples/tins, nq/tid, nq/tattr);
+		closeRelation(r);
+	}
+	dropRelation(BENCHREL);
+}
+
+// compare the old tupleMatch() path with compiled predicates
+// each query is checked against every input tuple
+
+static void benchMatch(int nq)
+{
+	int i, j, a;
+	char qstr[MAXTUPLEN];
+	if (nq == 0) nq = 1000;
+
+	dropRelation(BENCHREL);
+	if (newRelation(BENCHREL, natts, 2, 1, "", PAGESIZE,
+	                SPLIT_COUNT, 0) != OK)
+		fatal("Can't create benchmark relation");
+	Reln r = openRelation(BENCHREL, "r");
+
+	printf("%d tuples, %d attrs, %d queries per test\n", ntuples, natts, nq);
+	printf("%-6s %14s %14s %8s\n", "attr", "tupleMatch/s", "predMatch/s",
+	       "speedup");
+	for (a = 0; a < natts; a++) {
+		long n1 = 0, n2 = 0;
+		srand(1);
+		double t0 = now();
+		for (i = 0; i < nq; i++) {
+			makeQuery(tuples[rand() % ntuples], a, qstr);
+			for (j = 0; j < ntuples; j++)
+				n1 += tupleMatch(r, tuples[j], qstr);
+		}
+		double told = now() - t0;
+		srand(1);
+		t0 = now();
+		for (i = 0; i < nq; i++) {
+			makeQuery(tuples[rand() % ntuples], a, qstr);
+			Pred p = compilePred(r, qstr);
+			for (j = 0; j < ntuples; j++)
+				n2 += predMatch(p, tuples[j]);
+			freePred(p);
+		}
+		double tnew = now() - t0;
+		if (n1 != n2) fatal("tupleMatch and predMatch disagree");
+		double total = (double)nq * ntuples;
+		printf("%-6d %14.0f %14.0f %7.1fx\n", a, total/told, total/tnew,
+		       told/tnew);
+	}
+	closeRelation(r);
+	dropRelation(BENCHREL);
+}
+
+// time splitting bucket 0 of a depth-1 relation, for a range of
+//   chain lengths; the bucket is filled via reScheduleRelation(),
+//   which never triggers a split itself
+// a chain of n full pages is followed by one holding a single tuple
+
+static void benchSplit(int nreps)
+{
+	Count lens[] = { 1, 2, 4, 8, 16, 32, 64 };
+	int i, j, k, nlens = sizeof(lens)/sizeof(lens[0]);
+	if (nreps == 0) nreps = 20;
+
+	printf("%d tuples, %d attrs, %d splits per test\n", ntuples, natts, nreps);
+	printf("%-8s %8s %12s %12s\n", "fullpgs", "#tuples", "us/split",
+	       "ns/tuple");
+	for (i = 0; i < nlens; i++) {
+		double total = 0;
+		Count nchain = 0, nin = 0;
+		for (k = 0; k < nreps; k++) {
+			dropRelation(BENCHREL);
+			if (newRelation(BENCHREL, natts, 2, 1, "", PAGESIZE,
+	                SPLIT_COUNT, 0) != OK)
+				fatal("Can't create benchmark relation");
+			Reln r = openRelation(BENCHREL, "r+");
+			nin = 0;
+			for (j = 0; j < ntuples; j++) {
+				if (getLower(tupleHash(r, tuples[j]), 1) != 0) continue;
+				off_t end = lseek(ovflowFile(r), 0, SEEK_END);
+				nchain = 1 + end/PAGESIZE;
+				if (nchain > lens[i]) break;
+				if (reScheduleRelation(r, tuples[j], 0) == NO_PAGE)
+					fatal("Insert failed");
+				nin++;
+			}
+			double t0 = now();
+			splitRelation(r);
+			total += now() - t0;
+			closeRelation(r);
+		}
+		double us = 1e6*total/nreps;
+		printf("%-8d %8d %12.1f %12.1f\n", lens[i], nin, us, 1e3*us/nin);
+		if (nchain <= lens[i]) break;  // ran out of input
+	}
+	dropRelation(BENCHREL);
+}
+
+// compare insert throughput with the log synced every window
+//   inserts (window 0 = no log); close includes the final checkpoint
+
+static void benchWal(int nins)
+{
+	Count windows[] = { 0, 1, 4, 16, 64, 256, 1024 };
+	int i, j, nwins = sizeof(windows)/sizeof(windows[0]);
+	if (nins == 0) nins = 10000;
+	if (nins > ntuples) nins = ntuples;
+
+	printf("%d inserts, %d attrs\n", nins, natts);
+	printf("%-8s %12s %12s %10s\n", "window", "inserts/s", "us/insert",
+	       "close(ms)");
+	for (i = 0; i < nwins; i++) {
+		dropRelation(BENCHREL);
+		if (newRelation(BENCHREL, natts, 2, 1, "", PAGESIZE,
+		                SPLIT_COUNT, 0) != OK)
+			fatal("Can't create benchmark relation");
+		Reln r = openRelation(BENCHREL, "r+");
+		if (windows[i] > 0 && !logRelation(r, BENCHREL, windows[i]))
+			fatal("Can't log benchmark relation");
+		double t0 = now();
+		for (j = 0; j < nins; j++) {
+			Tuple t = copyString(tuples[j]);
+			if (addToRelation(r, t) == NO_PAGE) fatal("Insert failed");
+			free(t);
+		}
+		double tins = now() - t0;
+		t0 = now();
+		closeRelation(r);
+		double tclose = now() - t0;
+		if (windows[i] == 0)
+			printf("%-8s", "none");
+		else
+			printf("%-8d", windows[i]);
+		printf(" %12.0f %12.1f %10.1f\n", nins/tins, 1e6*tins/nins,
+		       1e3*tclose);
+	}
+	dropRelation(BENCHREL);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) fatal(USAGE);
+	int nq = (argc < 3) ? 0 : atoi(argv[2]);
+	if (argc >= 3 && nq < 1) fatal(USAGE);
+
+	readInput();
+	if (strcmp(argv[1], "pagesize") == 0)
+		benchPageSize(nq);
+	else if (strcmp(argv[1], "match") == 0)
+		benchMatch(nq);
+	else if (strcmp(argv[1], "split") == 0)
+		benchSplit(nq);
+	else if (strcmp(argv[1], "wal") == 0)
+		benchWal(nq);
+	else
+		fatal(USAGE);
+	return 0;
+}
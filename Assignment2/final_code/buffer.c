@@ -0,0 +1,312 @@
+// buffer.c ... shared buffer pool
+// part of Multi-attribute Linear-hashed Files
+// Keeps recently used pages in memory between getPage/putPage calls
+
+#include <pthread.h>
+#include "defs.h"
+#include "buffer.h"
+
+// Every Page handed out by this module is preceded by a small tag
+// - the tag holds the index of the frame containing the page
+// - pages not in the pool (scratch pages) have tag NO_FRAME
+// Frames are located via a chained hash table on (fd,pid)
+// Replacement is by the clock algorithm over unpinned frames
+// Dirty pages are only written when evicted or flushed
+// Frames grow to fit the page size of whichever file they hold
+// The pool is shared by all threads; poolLock covers every frame's
+//   bookkeeping, but not page contents (see reln.c for bucket latches)
+// poolLock is not held during page I/O; a frame being read or written
+//   is pinned and marked busy, and threads that want its page wait on
+//   ioDone until it is not
+
+#define TAGSIZE  16
+#define NO_FRAME (-1)
+#define NHASH    (2*NBUFFERS)
+
+typedef struct {
+	int     fd;    // file the page came from (-1 if frame unused)
+	PageID  pid;   // page's index within that file
+	Count   pins;  // number of current users of the page
+	Bool    dirty; // modified since it was read?
+	Bool    used;  // reference bit for clock sweep
+	Bool    busy;  // being read or written?
+	Count   cap;   // # bytes the frame's buffer can hold
+	int     next;  // next frame in same hash chain
+	Page    page;  // buffer holding the page contents
+} Frame;
+
+static Frame frames[NBUFFERS];
+static int   hashtab[NHASH];
+static int   clockhand = 0;
+static Bool  initialised = FALSE;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ioDone = PTHREAD_COND_INITIALIZER;
+
+static Count nhits = 0, nmisses = 0, nreads = 0, nwrites = 0;
+
+static int *tagOf(Page p) { return (int *)((char *)p - TAGSIZE); }
+
+static Page taggedPage(int frame, Count size)
+{
+	char *buf = malloc(TAGSIZE + size);
+	assert(buf != NULL);
+	*(int *)buf = frame;
+	return (Page)(buf + TAGSIZE);
+}
+
+// make sure frame i can hold a page from file fd
+static void fitFrame(int i, int fd)
+{
+	Count size = filePageSize(fd);
+	if (frames[i].cap >= size) return;
+	char *buf = realloc((char *)frames[i].page - TAGSIZE, TAGSIZE + size);
+	assert(buf != NULL);
+	frames[i].page = (Page)(buf + TAGSIZE);
+	frames[i].cap = size;
+}
+
+static void initPool()
+{
+	int i;
+	for (i = 0; i < NBUFFERS; i++) {
+		frames[i].fd = -1;
+		frames[i].pid = NO_PAGE;
+		frames[i].pins = 0;
+		frames[i].dirty = FALSE;
+		frames[i].used = FALSE;
+		frames[i].busy = FALSE;
+		frames[i].next = NO_FRAME;
+		frames[i].page = taggedPage(i, PAGESIZE);
+		frames[i].cap = PAGESIZE;
+	}
+	for (i = 0; i < NHASH; i++) hashtab[i] = NO_FRAME;
+	initialised = TRUE;
+}
+
+static int hashOf(int fd, PageID pid)
+{
+	unsigned int h = (fd * 40503u) ^ (pid * 2654435761u);
+	return h % NHASH;
+}
+
+static int lookup(int fd, PageID pid)
+{
+	int i = hashtab[hashOf(fd,pid)];
+	while (i != NO_FRAME && (frames[i].fd != fd || frames[i].pid != pid))
+		i = frames[i].next;
+	return i;
+}
+
+static void unlinkFrame(int i)
+{
+	int *prev = &hashtab[hashOf(frames[i].fd,frames[i].pid)];
+	while (*prev != i) prev = &frames[*prev].next;
+	*prev = frames[i].next;
+	frames[i].next = NO_FRAME;
+	frames[i].fd = -1;
+	frames[i].pid = NO_PAGE;
+}
+
+static void linkFrame(int i, int fd, PageID pid)
+{
+	int h = hashOf(fd,pid);
+	frames[i].fd = fd;
+	frames[i].pid = pid;
+	frames[i].next = hashtab[h];
+	hashtab[h] = i;
+}
+
+// write back frame i; poolLock is dropped during the write
+// the page is marked clean first, so changes made meanwhile by
+//   anyone holding a pin are not lost
+
+static void writeFrame(int i)
+{
+	Frame *fr = &frames[i];
+	fr->busy = TRUE;
+	fr->pins++;
+	fr->dirty = FALSE;
+	nwrites++;
+	pthread_mutex_unlock(&poolLock);
+	writePage(fr->fd, fr->pid, fr->page);
+	pthread_mutex_lock(&poolLock);
+	fr->busy = FALSE;
+	fr->pins--;
+	pthread_cond_broadcast(&ioDone);
+}
+
+// frame holding (fd,pid), once any I/O on it is done, or NO_FRAME
+
+static int lookupIdle(int fd, PageID pid)
+{
+	int i;
+	while ((i = lookup(fd, pid)) != NO_FRAME && frames[i].busy)
+		pthread_cond_wait(&ioDone, &poolLock);
+	return i;
+}
+
+// find a frame to (re)use; write back its old contents if needed
+// poolLock may be dropped meanwhile, so the caller must look up
+//   its page again afterwards
+
+static int victim()
+{
+	int i, tries;
+	for (tries = 0; tries < 2*NBUFFERS; tries++) {
+		i = clockhand;
+		clockhand = (clockhand+1) % NBUFFERS;
+		if (frames[i].pins > 0) continue;
+		if (frames[i].used) { frames[i].used = FALSE; continue; }
+		if (frames[i].fd >= 0) {
+			if (frames[i].dirty) writeFrame(i);
+			// no-one can have pinned it while busy
+			assert(frames[i].pins == 0 && !frames[i].dirty);
+			unlinkFrame(i);
+		}
+		return i;
+	}
+	fatal("Buffer pool exhausted: all pages are pinned");
+	return NO_FRAME;
+}
+
+// fetch a page into the pool and pin it
+// the page is read without poolLock; the frame is linked in first,
+//   and marked busy, so other threads wanting it wait for the read
+
+Page pinPage(int fd, PageID pid)
+{
+	pthread_mutex_lock(&poolLock);
+	if (!initialised) initPool();
+	int i = lookupIdle(fd, pid);
+	if (i != NO_FRAME)
+		nhits++;
+	else {
+		// another thread may have read the page while victim() wrote;
+		//   v is pinned while we look, so it isn't taken meanwhile
+		int v = victim();
+		frames[v].pins++;
+		i = lookupIdle(fd, pid);
+		frames[v].pins--;
+		if (i != NO_FRAME)
+			nhits++;
+		else {
+			nmisses++;
+			i = v;
+			fitFrame(i, fd);
+			linkFrame(i, fd, pid);
+			frames[i].dirty = FALSE;
+			frames[i].busy = TRUE;
+			frames[i].pins++;
+			nreads++;
+			pthread_mutex_unlock(&poolLock);
+			readPage(fd, pid, frames[i].page);
+			pthread_mutex_lock(&poolLock);
+			frames[i].busy = FALSE;
+			frames[i].pins--;
+			pthread_cond_broadcast(&ioDone);
+		}
+	}
+	frames[i].pins++;
+	frames[i].used = TRUE;
+	Page p = frames[i].page;
+	pthread_mutex_unlock(&poolLock);
+	return p;
+}
+
+// give up one pin on a pooled page
+
+void unpinPage(Page p, Bool dirty)
+{
+	int i = *tagOf(p);
+	pthread_mutex_lock(&poolLock);
+	assert(i != NO_FRAME && frames[i].pins > 0);
+	frames[i].pins--;
+	if (dirty) frames[i].dirty = TRUE;
+	pthread_mutex_unlock(&poolLock);
+}
+
+// scratch pages live outside the pool until stored
+
+Page allocPage(Count size)
+{
+	return taggedPage(NO_FRAME, size);
+}
+
+void freePage(Page p)
+{
+	assert(*tagOf(p) == NO_FRAME);
+	free((char *)p - TAGSIZE);
+}
+
+// copy a scratch page into the pool as the new contents of (fd,pid)
+
+void storePage(int fd, PageID pid, Page p)
+{
+	pthread_mutex_lock(&poolLock);
+	if (!initialised) initPool();
+	int i = lookupIdle(fd, pid);
+	if (i == NO_FRAME) {
+		int v = victim();
+		frames[v].pins++;
+		i = lookupIdle(fd, pid);
+		frames[v].pins--;
+		if (i == NO_FRAME) {
+			i = v;
+			fitFrame(i, fd);
+			linkFrame(i, fd, pid);
+		}
+	}
+	memcpy(frames[i].page, p, filePageSize(fd));
+	frames[i].dirty = TRUE;
+	frames[i].used = TRUE;
+	pthread_mutex_unlock(&poolLock);
+}
+
+Bool isBufferPage(Page p)
+{
+	return (*tagOf(p) != NO_FRAME);
+}
+
+// write back all dirty pages belonging to a file
+
+void flushPages(int fd)
+{
+	int i;
+	pthread_mutex_lock(&poolLock);
+	for (i = 0; initialised && i < NBUFFERS; i++) {
+		while (frames[i].fd == fd && frames[i].busy)
+			pthread_cond_wait(&ioDone, &poolLock);
+		if (frames[i].fd == fd && frames[i].dirty) writeFrame(i);
+	}
+	pthread_mutex_unlock(&poolLock);
+}
+
+// write back and forget all pages belonging to a file
+// must be called before the file is closed
+
+void dropPages(int fd)
+{
+	int i;
+	flushPages(fd);
+	pthread_mutex_lock(&poolLock);
+	for (i = 0; initialised && i < NBUFFERS; i++) {
+		while (frames[i].fd == fd && frames[i].busy)
+			pthread_cond_wait(&ioDone, &poolLock);
+		if (frames[i].fd != fd) continue;
+		assert(frames[i].pins == 0);
+		unlinkFrame(i);
+		frames[i].used = FALSE;
+	}
+	pthread_mutex_unlock(&poolLock);
+}
+
+// display buffer pool counters
+
+void bufferStats()
+{
+	Count nrefs = nhits + nmisses;
+	printf("Buffer pool: %d frames\n", NBUFFERS);
+	printf("hits:%d  misses:%d  hit-rate:%.1f%%  reads:%d  writes:%d\n",
+	       nhits, nmisses, nrefs == 0 ? 0.0 : 100.0*nhits/nrefs,
+	       nreads, nwrites);
+}
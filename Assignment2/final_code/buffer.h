@@ -0,0 +1,23 @@
+// buffer.h ... interface to the shared buffer pool
+// part of Multi-attribute Linear-hashed Files
+// See buffer.c for details of frames and replacement
+
+#ifndef BUFFER_H
+#define BUFFER_H 1
+
+#include "defs.h"
+#include "page.h"
+
+#define NBUFFERS 64
+
+Page pinPage(int, PageID);
+void unpinPage(Page, Bool dirty);
+Page allocPage(Count);
+void freePage(Page);
+void storePage(int, PageID, Page);
+Bool isBufferPage(Page);
+void flushPages(int);
+void dropPages(int);
+void bufferStats(void);
+
+#endif
@@ -69,3 +69,29 @@ void printChVec(ChVec cv)
 	}
 	printf("\n");
 }
+
+// build per-attribute lookup tables from a choice vector
+// m[a].mask holds all tuple-hash bits that come from attribute a
+
+ChVecMap *compileChVec(ChVec cv, Count nattrs)
+{
+	ChVecMap *m = calloc(nattrs, sizeof(ChVecMap));
+	assert(m != NULL);
+	int i, v;
+	for (i = 0; i < MAXCHVEC; i++) {
+		ChVecMap *am = &m[cv[i].att];
+		int k = cv[i].bit / 8, b = cv[i].bit % 8;
+		for (v = 0; v < 256; v++)
+			if (v & (1 << b)) am->byte[k][v] |= (1u << i);
+		am->mask |= (1u << i);
+	}
+	return m;
+}
+
+// map an attribute's hash value onto tuple-hash bits
+
+Bits chvecApply(ChVecMap *m, Bits h)
+{
+	return m->byte[0][h & 0xff] | m->byte[1][(h >> 8) & 0xff]
+	     | m->byte[2][(h >> 16) & 0xff] | m->byte[3][h >> 24];
+}
@@ -9,6 +9,7 @@
 #define CHVEC_H 1
 
 #include "defs.h"
+#include "bits.h"
 #include "reln.h"
 
 #define MAXCHVEC 32
@@ -17,7 +18,14 @@ typedef struct _ChVecItem { Byte att; Byte bit; } ChVecItem;
 
 typedef ChVecItem ChVec[MAXCHVEC];
 
+// choice vector compiled for one attribute
+// byte[k][v] = bits of tuple hash produced when byte k of the
+//   attribute's hash has value v
+typedef struct _ChVecMap { Bits byte[4][256]; Bits mask; } ChVecMap;
+
 Status parseChVec(Reln r, char *str, ChVec cv);
 void printChVec(ChVec cv);
+ChVecMap *compileChVec(ChVec cv, Count nattrs);
+Bits chvecApply(ChVecMap *m, Bits h);
 
 #endif
@@ -1,10 +1,15 @@
 // create.c ... create an empty Relation
 // part of Multi-attribute linear-hashed files
 // Ask a query on a named file
-// Usage:  ./create  [-v]  RelName  #attrs  #pages  ChoiceVector
+// Usage:  ./create  [-v]  [-p PageSize]  [-s Split]  RelName  #attrs  #pages  ChoiceVector
 // where #attrs = # of attributes in each tuple
 //	   #pages = initial (empty) pages in File
 //	   ChoiceVector = attr,bit:attr,bit:...
+//	   PageSize = bytes per page, e.g. 4096 or 4K (default 1K)
+//	   Split = when to split a bucket (default count)
+//	     count = every pagesize/(10*#attrs) inserts
+//	     load:N = when the load factor exceeds N%
+//	     ovflow:N = when overflow pages exceed N% of primary pages
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,8 +17,28 @@
 #include "util.h"
 #include "reln.h"
 
-#define USAGE "./create  [-v]  RelName  #attrs  #pages  ChoiceVector"
+#define USAGE "./create  [-v]  [-p PageSize]  [-s Split]  RelName  #attrs  #pages  ChoiceVector"
 
+// convert e.g. "load:75" to a split policy and threshold; FALSE if invalid
+
+static Bool parseSplit(char *str, Count *split, Count *arg)
+{
+	char *colon = strchr(str, ':');
+	int n = (colon == NULL) ? 0 : atoi(colon+1);
+	if (strcmp(str, "count") == 0) {
+		*split = SPLIT_COUNT; *arg = 0;
+		return TRUE;
+	}
+	if (colon == NULL || n < 1 || n > 1000) return FALSE;
+	*arg = n;
+	if (strncmp(str, "load:", 5) == 0)
+		*split = SPLIT_LOAD;
+	else if (strncmp(str, "ovflow:", 7) == 0)
+		*split = SPLIT_OVFLOW;
+	else
+		return FALSE;
+	return TRUE;
+}
 
 // Main ... process args, create relation
 
@@ -28,18 +53,36 @@ int main(int argc, char **argv)
 	char *attrs;   // number of attributes in tuples
 	char *pages;   // number of pages in data file
 	char *cv;	  // choice vector
+	int pagesize = PAGESIZE;  // bytes per page
+	Count split = SPLIT_COUNT, splitarg = 0;  // split policy
 
 	// Process command-line args
 
-	if (argc < 2) fatal(USAGE);
-	if (strcmp(argv[1], "-v") == 0) {
-		if (argc < 6) fatal(USAGE);
-	    verbose = 1; rname = argv[2]; attrs = argv[3]; pages = argv[4]; cv = argv[5];
-	}
-	else {
-		if (argc < 5) fatal(USAGE);
-	    verbose = 0; rname = argv[1]; attrs = argv[2]; pages = argv[3]; cv = argv[4];
+	int a = 1;
+	verbose = 0;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-p") == 0 && a+1 < argc) {
+			// how big is each page
+			if ((pagesize = parsePageSize(argv[++a])) == 0) {
+				sprintf(err, "Invalid page size: %s (must be power of 2, %d..%d)",
+				        argv[a], MINPAGESIZE, MAXPAGESIZE);
+				fatal(err);
+			}
+		}
+		else if (strcmp(argv[a], "-s") == 0 && a+1 < argc) {
+			if (!parseSplit(argv[++a], &split, &splitarg)) {
+				sprintf(err, "Invalid split policy: %s", argv[a]);
+				fatal(err);
+			}
+		}
+		else
+			fatal(USAGE);
+		a++;
 	}
+	if (argc - a < 4) fatal(USAGE);
+	rname = argv[a]; attrs = argv[a+1]; pages = argv[a+2]; cv = argv[a+3];
 
 	// how many attributes in each tuple
 	nattrs = atoi(attrs);
@@ -60,7 +103,8 @@ int main(int argc, char **argv)
 	while (np < npages) { d++; np <<= 1; }
 
 	if (verbose)
-		printf("#a=%d, #p=%d, d=%d\n", nattrs, np, d);
+		printf("#a=%d, #p=%d, d=%d, pagesize=%d, split=%s\n", nattrs, np, d,
+		       pagesize, splitPolicyString(split, splitarg));
 
 	// Open files for the Relation and initialise
 
@@ -68,7 +112,8 @@ int main(int argc, char **argv)
 		sprintf(err, "Relation %s already exists", rname);
 		fatal(err);
 	}
-	if (newRelation(rname, nattrs, np, d, cv) != OK) {
+	if (newRelation(rname, nattrs, np, d, cv, pagesize, split,
+	                splitarg) != OK) {
 		sprintf(err, "Problems while creating relation %s", rname);
 		fatal(err);
 	}
@@ -12,7 +12,9 @@
 #include <assert.h>
 #include "util.h"
 
-#define PAGESIZE    1024
+#define PAGESIZE    1024   // default; set per relation by create
+#define MINPAGESIZE 512
+#define MAXPAGESIZE 65536
 #define NO_PAGE     0xffffffff
 #define MAXERRMSG   200
 #define MAXTUPLEN   200
@@ -0,0 +1,67 @@
+// delete.c ... delete tuples from a relation
+// part of Multi-attribute linear-hashed files
+// Deletes every tuple in a named relation that matches a query
+// Usage:  ./delete  [-v]  [-w]  RelName  v1,v2,v3,v4,...
+// where any of the vi's can be "?" (unknown)
+// -w logs the delete, so it is durable once ./delete finishes
+
+#include "defs.h"
+#include "reln.h"
+
+#define USAGE "./delete  [-v]  [-w]  RelName  v1,v2,v3,v4,..."
+
+// Main ... process args, delete tuples
+
+int main(int argc, char **argv)
+{
+	Reln r;  // handle on the open relation
+	char err[2*MAXERRMSG];  // buffer for error messages
+	int verbose;  // show how many tuples were deleted
+	int logged;   // log the delete?
+	char *rname;  // name of table/file
+	char *qstr;   // query string
+
+	// process command-line args
+
+	int a = 1;
+	verbose = 0;  logged = 0;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-w") == 0)
+			logged = 1;
+		else
+			fatal(USAGE);
+		a++;
+	}
+	if (argc - a < 2) fatal(USAGE);
+	rname = argv[a];  qstr = argv[a+1];
+
+	// set up relation for writing
+
+	if (!existsRelation(rname)) {
+		sprintf(err, "No such relation: %s", rname);
+		fatal(err);
+	}
+	if ((r = openRelation(rname,"r+")) == NULL) {
+		sprintf(err, "Can't open relation: %s",rname);
+		fatal(err);
+	}
+	if (logged && !logRelation(r, rname, 1)) {
+		sprintf(err, "Relation %s is being logged by another process", rname);
+		fatal(err);
+	}
+
+	int n = deleteFromRelation(r, qstr);
+	if (n < 0) {
+		sprintf(err, "Invalid query: %s",qstr);
+		fatal(err);
+	}
+	if (verbose) printf("%d tuples deleted\n", n);
+
+	// clean up
+
+	closeRelation(r);
+
+	return 0;
+}
@@ -2,15 +2,18 @@
 // part of Multi-attribute linear-hashed files
 // Show tuples, bucket-by-bucket
 // Last modified by John Shepherd, July 2019
-// Usage:  ./stats  RelName
+// Usage:  ./dump  [-m|-s]  RelName
+// -s just lists the tuples, in file order, via a sequential scan
 
 #include "defs.h"
 #include "reln.h"
 #include "page.h"
+#include "scan.h"
 
 void showAllTuples(Page);
 
-#define USAGE "./dump  RelName"
+#define USAGE "./dump  [-m|-s]  RelName"
+#define OUTBUF (1 << 20)  // bytes of output buffered by -s
 
 // Main ... process args, scan data, show tuples
 
@@ -19,16 +22,32 @@ int main(int argc, char **argv)
 	// process command-line args
 
 	if (argc < 2) fatal(USAGE);
-	char *relname = argv[1];
+	char *relname = argv[1], *mode = "r";
+	Bool seq = FALSE;
+	if (strcmp(argv[1], "-m") == 0 || strcmp(argv[1], "-s") == 0) {
+		if (argc < 3) fatal(USAGE);
+		relname = argv[2];
+		if (argv[1][1] == 'm') mode = "rm"; else seq = TRUE;
+	}
 
 	// open relation and show stats
 
 	if (!existsRelation(relname))
 		fatal("No such relation");
-	Reln r = openRelation(relname,"r");
+	Reln r = openRelation(relname,mode);
 	if (r == NULL)
 		fatal("Can't open relation");
 
+	if (seq) {
+		setvbuf(stdout, NULL, _IOFBF, OUTBUF);
+		Scan s = startScan(r);
+		Page pg;
+		while ((pg = nextScanPage(s, FALSE)) != NULL) showAllTuples(pg);
+		closeScan(s);
+		closeRelation(r);
+		return 0;
+	}
+
 	for (Offset pid = 0; pid < npages(r); pid++) {
 		printf("Bucket[%d]\n",pid);
 		// show tuples in data file
@@ -42,9 +61,9 @@ int main(int argc, char **argv)
 			ovpg = getPage(ovflowFile(r), ovp);
 			showAllTuples(ovpg);
 			ovp = pageOvflow(ovpg);
-			free(ovpg);
+			releasePage(ovpg);
 		}
-		free(pg);
+		releasePage(pg);
 	}
 	closeRelation(r);
 
@@ -56,9 +75,9 @@ int main(int argc, char **argv)
 void showAllTuples(Page pg)
 {
 		Count ntups = pageNTuples(pg);
-		char *c = pageData(pg);
 		for (int i = 0; i < ntups; i++) {
-			printf("%s\n", c);
-			c += strlen(c) + 1;
+			if (!pageTupleLive(pg,i)) continue;
+			fwrite(pageTuple(pg,i), 1, pageTupleLen(pg,i), stdout);
+			putchar('\n');
 		}
 }
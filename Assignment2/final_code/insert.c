@@ -1,14 +1,166 @@
 // insert.c ... add tuples to a relation
 // part of Multi-attribute linear-hashed files
 // Reads tuples from stdin and inserts into Reln
-// Usage:  ./insert  [-v]  RelName
+// Usage:  ./insert  [-v]  [-b|-c|-w N]  [-M MB]  [-j N]  RelName
+// -b bulk loads an empty relation, writing each bucket once
+// -M sets how many MB of tuples -b may hold in memory (default 256)
+// -j inserts using N hashing threads and N inserting threads
+// -c lets "select -c" run on the relation during the inserts
+// -w logs the inserts, syncing the log after every N of them
 // Last modified by John Shepherd, July 2019
 
+#include <pthread.h>
 #include "defs.h"
 #include "reln.h"
 #include "tuple.h"
 
-#define USAGE "./insert  [-v]  RelName"
+#define USAGE "./insert  [-v]  [-b|-c|-w N]  [-M MB]  [-j N]  RelName"
+#define BULKMEM 256  // default MB of tuples held in memory by -b
+#define MAXJOBS 64   // max threads of each kind for -j
+#define BATCH   256  // tuples passed between threads at a time
+#define QMAX    16   // max batches waiting in a queue
+
+// Parallel insert (-j)
+// main thread reads and checks tuples, in batches, onto hashq
+// hasher threads hash them and route each to an inserter thread by
+//   the latch its bucket uses; once there are NLATCHES buckets, bucket
+//   p's latch is p % NLATCHES = h % NLATCHES, so for any N each latch,
+//   and so each bucket, is used by one inserter
+// see addToRelationShared() for the locking
+
+typedef struct Batch {
+	int    n;  // # tuples, or -1 to say there are no more
+	Tuple  tup[BATCH];
+	Bits   hash[BATCH];
+	struct Batch *next;
+} Batch;
+
+typedef struct {
+	Batch *head, *tail;
+	int    len;
+	pthread_mutex_t lock;
+	pthread_cond_t  changed;
+} Queue;
+
+static Reln    rel;
+static Queue   hashq, workq[MAXJOBS];
+static int     njobs;
+static int     verbose;  // show extra info on query progress
+
+static void initQueue(Queue *q)
+{
+	q->head = q->tail = NULL;
+	q->len = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->changed, NULL);
+}
+
+static void push(Queue *q, Batch *b)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->len >= QMAX) pthread_cond_wait(&q->changed, &q->lock);
+	b->next = NULL;
+	if (q->tail == NULL) q->head = b; else q->tail->next = b;
+	q->tail = b;
+	q->len++;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static Batch *pop(Queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->head == NULL) pthread_cond_wait(&q->changed, &q->lock);
+	Batch *b = q->head;
+	q->head = b->next;
+	if (q->head == NULL) q->tail = NULL;
+	q->len--;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+	return b;
+}
+
+static Batch *newBatch(int n)
+{
+	Batch *b = malloc(sizeof(Batch));
+	assert(b != NULL);
+	b->n = n;
+	return b;
+}
+
+static void *hasher(void *arg)
+{
+	Batch *out[MAXJOBS];
+	int i, w;
+	for (w = 0; w < njobs; w++) out[w] = newBatch(0);
+	Batch *b;
+	while ((b = pop(&hashq))->n >= 0) {
+		for (i = 0; i < b->n; i++) {
+			Bits h = tupleHash(rel, b->tup[i]);
+			w = (h % NLATCHES) % njobs;
+			Batch *o = out[w];
+			o->tup[o->n] = b->tup[i];
+			o->hash[o->n] = h;
+			if (++o->n == BATCH) {
+				push(&workq[w], o);
+				out[w] = newBatch(0);
+			}
+		}
+		free(b);
+	}
+	free(b);
+	for (w = 0; w < njobs; w++) {
+		if (out[w]->n > 0) push(&workq[w], out[w]); else free(out[w]);
+	}
+	return NULL;
+}
+
+static void *inserter(void *arg)
+{
+	Queue *q = arg;
+	char err[2*MAXERRMSG];
+	int i;
+	Batch *b;
+	while ((b = pop(q))->n >= 0) {
+		for (i = 0; i < b->n; i++) {
+			PageID pid = addToRelationShared(rel, b->tup[i], b->hash[i]);
+			if (pid == NO_PAGE) {
+				sprintf(err, "Insert of %s failed\n", b->tup[i]);
+				fatal(err);
+			}
+			if (verbose) printf("%s -> %d\n", b->tup[i], pid);
+			free(b->tup[i]);
+		}
+		free(b);
+	}
+	free(b);
+	return NULL;
+}
+
+static void parallelInsert(Reln r, int n)
+{
+	pthread_t hashers[MAXJOBS], inserters[MAXJOBS];
+	int i;
+	rel = r;  njobs = n;
+	shareRelation(r);
+	initQueue(&hashq);
+	for (i = 0; i < n; i++) {
+		initQueue(&workq[i]);
+		pthread_create(&hashers[i], NULL, hasher, NULL);
+		pthread_create(&inserters[i], NULL, inserter, &workq[i]);
+	}
+	Batch *b = newBatch(0);
+	Tuple t;
+	while ((t = readTuple(r,stdin)) != NULL) {
+		b->tup[b->n++] = t;
+		if (b->n == BATCH) { push(&hashq, b); b = newBatch(0); }
+	}
+	push(&hashq, b);
+	for (i = 0; i < n; i++) push(&hashq, newBatch(-1));
+	for (i = 0; i < n; i++) pthread_join(hashers[i], NULL);
+	for (i = 0; i < n; i++) push(&workq[i], newBatch(-1));
+	for (i = 0; i < n; i++) pthread_join(inserters[i], NULL);
+}
 
 // Main ... process args, read/insert tuples
 
@@ -18,16 +170,41 @@ int main(int argc, char **argv)
 	Tuple t;  // tuple buffer
 	char err[2*MAXERRMSG];  // buffer for error messages
 	char tup[MAXTUPLEN];  // buffer for printable tuples
-	int verbose;  // show extra info on query progress
 	char *rname;  // name of table/file
+	int bulk = 0;  // bulk load?
+	char *mode = "r+";  // "r+c" if readers may run alongside
+	int jobs = 0;  // # threads for parallel insert
+	int budget = BULKMEM;  // MB of tuples to hold in memory
+	int window = 0;  // # inserts per log sync, or 0 if not logging
 
 	// process command-line args
 
-	if (argc < 2) fatal(USAGE);
-    if (strcmp(argv[1], "-v") == 0)
-		{ verbose = 1; rname = argv[2]; }
-	else
-		{ verbose = 0; rname = argv[1]; }
+	int a = 1;
+	verbose = 0;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-b") == 0)
+			bulk = 1;
+		else if (strcmp(argv[a], "-c") == 0)
+			mode = "r+c";
+		else if (strcmp(argv[a], "-w") == 0 && a+1 < argc) {
+			window = atoi(argv[++a]);
+			if (window < 1) fatal(USAGE);
+		}
+		else if (strcmp(argv[a], "-M") == 0 && a+1 < argc)
+			budget = atoi(argv[++a]);
+		else if (strcmp(argv[a], "-j") == 0 && a+1 < argc) {
+			jobs = atoi(argv[++a]);
+			if (jobs < 1 || jobs > MAXJOBS) fatal(USAGE);
+		}
+		else
+			fatal(USAGE);
+		a++;
+	}
+	if (a >= argc || budget < 1) fatal(USAGE);
+	if (bulk + (mode[2] == 'c') + (window > 0) > 1) fatal(USAGE);
+	rname = argv[a];
 
 
 	// set up relation for writing
@@ -36,11 +213,35 @@ int main(int argc, char **argv)
 		sprintf(err, "No such relation: %s", rname);
 		fatal(err);
 	}
-	if ((r = openRelation(rname,"r+")) == NULL) {
-		sprintf(err, "Can't open relation: %s",argv[1]);
+	if ((r = openRelation(rname,mode)) == NULL) {
+		sprintf(err, "Can't open relation: %s",rname);
+		fatal(err);
+	}
+	if (window > 0 && !logRelation(r, rname, window)) {
+		sprintf(err, "Relation %s is being logged by another process", rname);
 		fatal(err);
 	}
 
+	// bulk load builds the whole relation in one go
+
+	if (bulk) {
+		int n = bulkLoadRelation(r, stdin, (size_t)budget << 20);
+		if (n < 0) {
+			sprintf(err, "Can't bulk load %s: must be empty and not use"
+			        " the ovflow split policy", rname);
+			fatal(err);
+		}
+		if (verbose) printf("%d tuples loaded\n", n);
+		closeRelation(r);
+		return 0;
+	}
+
+	if (jobs > 0) {
+		parallelInsert(r, jobs);
+		closeRelation(r);
+		return 0;
+	}
+
 	// read stdin and insert tuples
 
 	while ((t = readTuple(r,stdin)) != NULL) {
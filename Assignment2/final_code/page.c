@@ -3,103 +3,375 @@
 // Reading/writing pages into buffers and manipulating contents
 // Last modified by John Shepherd, July 2019
 
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
 #include "defs.h"
 #include "page.h"
+#include "buffer.h"
 
 // internal representation of pages
 struct PageRep {
+	Count  size;   // # bytes in whole page, including header
 	Offset free;   // offset within data[] of free space
 	Offset ovflow; // Offset of overflow page (if any)
-	Count ntuples; // #tuples in this page
+	PageID tail;   // last page in overflow chain (primary pages only)
+	Count tailfree; // # bytes free in tail page (primary pages only)
+	Count ntuples; // #tuples in this page (= #slots)
+	Count ndead;   // # of them that are deleted
+	Count dead;    // # bytes the deleted tuples use, incl. slots
 	char data[1];  // start of data
 };
 
-// A Page is a chunk of memory containing PAGESIZE bytes
-// It is implemented as a struct (free, ovflow, data[1])
+// slot directory entry; tuple i is described by slot i
+typedef struct {
+	unsigned short off;  // offset of tuple within data[]
+	unsigned short len;  // tuple length, excluding '\0'
+} Slot;
+
+#define HDRSIZE offsetof(struct PageRep, data)
+#define DEADLEN 0xFFFF  // Slot.len of a deleted tuple
+
+// A Page is a chunk of memory containing size bytes
+// It is implemented as a struct
+//   (size, free, ovflow, tail, tailfree, ntuples, ndead, dead, data[1])
+// - size is fixed per file, and recorded with the relation (see reln.c)
 // - free is the offset of the first byte of free space
 // - ovflow is the page id of the next overflow page in bucket
+// - tail and tailfree are kept up to date in a bucket's primary page,
+//   so inserts can go straight to the end of the overflow chain
 // - data[] is a sequence of bytes containing tuples
 // - each tuple is a sequence of chars terminated by '\0'
+// - a directory of Slots grows down from the end of the page
+// - slot i, i.e. ((Slot *)(page+size))[-1-i], locates tuple i
+// - a deleted tuple keeps its slot, marked DEADLEN, until the page
+//   is compacted; that happens when addToPage() needs the room, so
+//   free space counts the deleted tuples' space too
 // - PageID values count # pages from start of file
+// Pages returned by getPage() live in the buffer pool (see buffer.c)
+// - they stay pinned until given back via putPage() or releasePage()
+// - unless the file is mapped, in which case they point into the map
+
+// read-only memory mappings of page files
+// a file that grows is remapped; old mappings are kept until
+//   unmapPageFile(), since callers may still hold pages in them
+
+#define MAXMAPS 8
+
+typedef struct Mapping {
+	char   *base;  // start of mapped region (NULL if file empty)
+	size_t  len;   // # bytes mapped
+	struct Mapping *older;  // superseded mappings of same file
+} Mapping;
+
+static int      mapfd[MAXMAPS];
+static Mapping *maps[MAXMAPS];
+static int      nmaps = 0;
+
+// page size of each open page file, indexed by descriptor
+
+#define MAXFD 1024
+
+static Count pagesizes[MAXFD];
+
+void setPageSize(int fd, Count size)
+{
+	assert(fd >= 0 && fd < MAXFD);
+	assert(size >= MINPAGESIZE && size <= MAXPAGESIZE);
+	pagesizes[fd] = size;
+}
+
+Count filePageSize(int fd)
+{
+	assert(fd >= 0 && fd < MAXFD && pagesizes[fd] != 0);
+	return pagesizes[fd];
+}
 
 // create a new initially empty page in memory
-Page newPage()
+Page newPage(Count size)
 {
-	Page p = malloc(PAGESIZE);
-	assert(p != NULL);
+	Page p = allocPage(size);
+	p->size = size;
 	p->free = 0;
 	p->ovflow = NO_PAGE;
+	p->tail = NO_PAGE;
+	p->tailfree = 0;
 	p->ntuples = 0;
-	Count hdr_size = 2*sizeof(Offset) + sizeof(Count);
-	int dataSize = PAGESIZE - hdr_size;
-	memset(p->data, 0, dataSize);
+	p->ndead = 0;
+	p->dead = 0;
+	memset(p->data, 0, size - HDRSIZE);
 	return p;
 }
 
+// byte offset of a page within its file
+// done in off_t so that files can grow past 2GB
+static off_t pageOffset(int fd, PageID pid)
+{
+	return (off_t)pid * filePageSize(fd);
+}
+
+// page I/O for a file can be diverted elsewhere (see wal.c)
+
+static Divert *diverts[MAXFD];
+
+void divertPages(int fd, Divert *d)
+{
+	assert(fd >= 0 && fd < MAXFD);
+	diverts[fd] = d;
+}
+
+static void rawWritePage(int fd, PageID pid, Page p)
+{
+	Count size = filePageSize(fd);
+	ssize_t n = pwrite(fd, p, size, pageOffset(fd,pid));
+	assert(n == size);
+}
+
+// raw page I/O, bypassing the buffer pool
+void readPage(int fd, PageID pid, Page p)
+{
+	Divert *d = diverts[fd];
+	if (d != NULL && d->read(d->arg, fd, pid, p)) return;
+	Count size = filePageSize(fd);
+	ssize_t n = pread(fd, p, size, pageOffset(fd,pid));
+	assert(n == size);
+}
+
+// read up to n consecutive pages, from pid on, into buf
+// bypasses the buffer pool, and any diversion, so suits files that
+//   aren't being changed; returns # pages read, < n only at the end
+
+Count readPages(int fd, PageID pid, Count n, char *buf)
+{
+	Count size = filePageSize(fd);
+	size_t want = (size_t)n * size, got = 0;
+	while (got < want) {
+		ssize_t k = pread(fd, buf+got, want-got, pageOffset(fd,pid)+got);
+		assert(k >= 0);
+		if (k == 0) break;
+		got += k;
+	}
+	return got / size;
+}
+
+void writePage(int fd, PageID pid, Page p)
+{
+	Divert *d = diverts[fd];
+	if (d != NULL)
+		d->write(d->arg, fd, pid, p);
+	else
+		rawWritePage(fd, pid, p);
+}
+
 // append a new Page to a file; return its PageID
-PageID addPage(FILE *f)
+PageID addPage(int fd)
 {
-	int ok = fseek(f, 0, SEEK_END);
-	assert(ok == 0);
-	int pos = ftell(f);
+	Count size = filePageSize(fd);
+	off_t pos = lseek(fd, 0, SEEK_END);
 	assert(pos >= 0);
-	PageID pid = pos/PAGESIZE;
-	Page p = newPage();
-	ok = putPage(f, pid, p);
-	assert(ok == 0);
+	PageID pid = pos/size;
+	// written directly, so that the file grows immediately
+	Page p = newPage(size);
+	rawWritePage(fd, pid, p);
+	freePage(p);
 	return pid;
 }
 
-// fetch a Page from a file; allocate a memory buffer
-Page getPage(FILE *f, PageID pid)
+// (re)map the whole of a file
+static Mapping *mapWholeFile(int fd, Mapping *older)
 {
-	assert(pid >= 0);
-	Page p = malloc(PAGESIZE);
-	assert(p != NULL);
-	int ok = fseek(f, pid*PAGESIZE, SEEK_SET);
+	struct stat st;
+	int ok = fstat(fd, &st);
 	assert(ok == 0);
-	int n = fread(p, 1, PAGESIZE, f);
-	assert(n == PAGESIZE);
-	return p;
+	Mapping *m = malloc(sizeof(Mapping));
+	assert(m != NULL);
+	m->len = st.st_size;
+	m->base = NULL;
+	m->older = older;
+	if (m->len > 0) {
+		m->base = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+		assert(m->base != MAP_FAILED);
+	}
+	return m;
+}
+
+static int findMap(int fd)
+{
+	int i;
+	for (i = 0; i < nmaps; i++)
+		if (mapfd[i] == fd) return i;
+	return -1;
 }
 
-// write a Page to a file; release allocated buffer
-Status putPage(FILE *f, PageID pid, Page p)
+// is p a page inside one of the mappings?
+static Bool isMappedPage(Page p)
+{
+	int i; Mapping *m;
+	char *c = (char *)p;
+	for (i = 0; i < nmaps; i++) {
+		for (m = maps[i]; m != NULL; m = m->older)
+			if (m->base != NULL && c >= m->base && c < m->base+m->len)
+				return TRUE;
+	}
+	return FALSE;
+}
+
+// serve all getPage() calls on fd from a read-only mapping
+void mapPageFile(int fd)
+{
+	assert(nmaps < MAXMAPS && findMap(fd) < 0);
+	mapfd[nmaps] = fd;
+	maps[nmaps] = mapWholeFile(fd, NULL);
+	nmaps++;
+}
+
+void unmapPageFile(int fd)
+{
+	int i = findMap(fd);
+	if (i < 0) return;
+	Mapping *m = maps[i], *next;
+	while (m != NULL) {
+		next = m->older;
+		if (m->base != NULL) munmap(m->base, m->len);
+		free(m);
+		m = next;
+	}
+	nmaps--;
+	mapfd[i] = mapfd[nmaps];
+	maps[i] = maps[nmaps];
+}
+
+Bool isMappedFile(int fd)
+{
+	return (findMap(fd) >= 0);
+}
+
+// fetch a Page from a file; pin it in the buffer pool
+// for a mapped file, just return a pointer into the mapping
+Page getPage(int fd, PageID pid)
 {
 	assert(pid >= 0);
-	int ok = fseek(f, pid*PAGESIZE, SEEK_SET);
-	assert(ok == 0);
-	int n = fwrite(p, 1, PAGESIZE, f);
-	assert(n == PAGESIZE);
-	free(p);
+	int i = (nmaps == 0) ? -1 : findMap(fd);
+	if (i < 0) return pinPage(fd, pid);
+	off_t end = pageOffset(fd,pid) + filePageSize(fd);
+	if (end > maps[i]->len) {
+		// file has grown since it was mapped
+		maps[i] = mapWholeFile(fd, maps[i]);
+		assert(end <= maps[i]->len);
+	}
+	return (Page)(maps[i]->base + pageOffset(fd,pid));
+}
+
+// write a Page to a file; release its buffer
+// the write itself is deferred until the pool evicts/flushes it
+Status putPage(int fd, PageID pid, Page p)
+{
+	assert(pid >= 0);
+	assert(nmaps == 0 || !isMappedPage(p));
+	if (isBufferPage(p))
+		unpinPage(p, TRUE);
+	else {
+		storePage(fd, pid, p);
+		freePage(p);
+	}
 	return 0;
 }
 
+// finished with a Page without changing it
+void releasePage(Page p)
+{
+	if (nmaps > 0 && isMappedPage(p))
+		return;
+	if (isBufferPage(p))
+		unpinPage(p, FALSE);
+	else
+		freePage(p);
+}
+
+static Slot *pageSlot(Page p, Count i)
+{
+	return (Slot *)((char *)p + p->size) - 1 - i;
+}
+
+// squeeze deleted tuples and their slots out of a page
+// live tuples keep their order, so their slots just move down
+
+static void compactPage(Page p)
+{
+	Count i, n = 0;
+	Offset free = 0;
+	for (i = 0; i < p->ntuples; i++) {
+		Slot *s = pageSlot(p, i);
+		if (s->len == DEADLEN) continue;
+		memmove(p->data + free, p->data + s->off, s->len+1);
+		Slot *d = pageSlot(p, n++);
+		d->len = s->len;
+		d->off = free;
+		free += d->len+1;
+	}
+	p->ntuples = n;
+	p->free = free;
+	p->ndead = 0;
+	p->dead = 0;
+	char *slots = (char *)p + p->size - n*sizeof(Slot);
+	memset(p->data + free, 0, slots - (p->data + free));
+}
+
+// mark tuple i as deleted
+
+void pageDeleteTuple(Page p, Count i)
+{
+	Slot *s = pageSlot(p, i);
+	assert(s->len != DEADLEN);
+	p->ndead++;
+	p->dead += s->len+1+sizeof(Slot);
+	s->len = DEADLEN;
+}
+
 // insert a tuple into a page
 // returns 0 status if successful
 // returns -1 if not enough room
 Status addToPage(Page p, Tuple t)
 {
 	int n = tupLength(t);
-	char *c = p->data + p->free;
-	Count hdr_size = 2*sizeof(Offset) + sizeof(Count);
 	// doesn't fit ... return fail code
 	// assume caller will put it elsewhere
-	if (c+n > &p->data[PAGESIZE-hdr_size-2]) return -1;
-	strcpy(c, t);
+	if (n+1+sizeof(Slot) > pageFreeSpace(p)) return -1;
+	if (n+1+sizeof(Slot) > pageFreeSpace(p) - p->dead) compactPage(p);
+	Slot *s = pageSlot(p, p->ntuples);
+	s->off = p->free;
+	s->len = n;
+	memcpy(p->data + p->free, t, n+1);
 	p->free += n+1;
 	p->ntuples++;
 	return OK;
 }
 
 // extract page info
-char *pageData(Page p) { return p->data; }
 Count pageNTuples(Page p) { return p->ntuples; }
+Count pageNLive(Page p) { return p->ntuples - p->ndead; }
+Offset pageFreeOffset(Page p) { return p->free; }
+Count pageSize(Page p) { return p->size; }
 Offset pageOvflow(Page p) { return p->ovflow; }
-Tuple getPageTuple(Page p, Offset offset){ return p->data + offset; }
 void pageSetOvflow(Page p, PageID pid) { p->ovflow = pid; }
+PageID pageTail(Page p) { return p->tail; }
+Count pageTailFree(Page p) { return p->tailfree; }
+void pageSetTail(Page p, PageID pid, Count free) {
+	p->tail = pid;
+	p->tailfree = free;
+}
+// # bytes available for tuples in an empty page of this size
+Count pageCapacity(Count size) { return size - HDRSIZE; }
+// # bytes of free space that adding t to a page will use up
+Count pageTupleSpace(Tuple t) { return tupLength(t)+1+sizeof(Slot); }
 Count pageFreeSpace(Page p) {
-	Count hdr_size = 2*sizeof(Offset) + sizeof(Count);
-	return (PAGESIZE-hdr_size-p->free);
+	return (p->size-HDRSIZE-p->ntuples*sizeof(Slot)-p->free) + p->dead;
 }
 
+// tuple i in page, and its length; 0 <= i < pageNTuples(p)
+// only meaningful if the tuple is live
+Tuple pageTuple(Page p, Count i) { return p->data + pageSlot(p,i)->off; }
+Count pageTupleLen(Page p, Count i) { return pageSlot(p,i)->len; }
+Bool pageTupleLive(Page p, Count i) { return pageSlot(p,i)->len != DEADLEN; }
+
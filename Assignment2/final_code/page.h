@@ -11,16 +11,43 @@ typedef struct PageRep *Page;
 #include "defs.h"
 #include "tuple.h"
 
-Page newPage();
-PageID addPage(FILE *);
-Page getPage(FILE *, PageID);
-Status putPage(FILE *, PageID, Page);
+// where a file's page reads and writes go instead, if diverted
+typedef struct {
+	Bool (*read)(void *arg, int fd, PageID pid, Page p);  // FALSE if not
+	void (*write)(void *arg, int fd, PageID pid, Page p);
+	void *arg;
+} Divert;
+
+void setPageSize(int, Count);
+Count filePageSize(int);
+Page newPage(Count);
+void readPage(int, PageID, Page);
+Count readPages(int, PageID, Count, char *);
+void writePage(int, PageID, Page);
+PageID addPage(int);
+void divertPages(int, Divert *);
+void mapPageFile(int);
+void unmapPageFile(int);
+Bool isMappedFile(int);
+Page getPage(int, PageID);
+Status putPage(int, PageID, Page);
+void releasePage(Page);
 Status addToPage(Page, Tuple);
-char *pageData(Page);
+void pageDeleteTuple(Page, Count);
 Count pageNTuples(Page);
+Count pageNLive(Page);
+Offset pageFreeOffset(Page);
+Count pageSize(Page);
 Offset pageOvflow(Page);
 void pageSetOvflow(Page, PageID);
-Tuple getPageTuple(Page, Offset);
+PageID pageTail(Page);
+Count pageTailFree(Page);
+void pageSetTail(Page, PageID, Count);
+Count pageCapacity(Count);
+Count pageTupleSpace(Tuple);
 Count pageFreeSpace(Page);
+Tuple pageTuple(Page, Count);
+Count pageTupleLen(Page, Count);
+Bool pageTupleLive(Page, Count);
 
 #endif
@@ -0,0 +1,431 @@
+// prefetch.c ... asynchronous page prefetching for queries
+// part of Multi-attribute Linear-hashed Files
+// Reads a query's candidate buckets ahead of the scan
+
+#define _DEFAULT_SOURCE  // for syscall()
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include "defs.h"
+#include "prefetch.h"
+#include "buffer.h"
+
+#if defined(__linux__) && defined(__has_include) && !defined(NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+// A Prefetch keeps up to PFDEPTH page reads queued or in flight
+// - primary pages are requested in the order of the bucket list
+// - once a page arrives, its overflow page (if any) is requested
+//   ahead of any further primary pages
+// - pages are read into private slot buffers, not the buffer pool,
+//   so the pool never sees more than the pages the scan is using
+// - prefetchPage() hands the scan a page for bucket bi, waiting if
+//   it is still being read; anything belonging to buckets before bi
+//   is no longer wanted and is discarded
+// - a page that was never requested is read synchronously
+// Reads are done via io_uring if the kernel supports it, otherwise
+//   by a small pool of threads doing pread()
+// Compiling with -DNO_IO_URING forces the thread pool
+
+typedef enum { FREE, QUEUED, LOADING, READY, INUSE } SlotState;
+
+typedef struct {
+	SlotState state;
+	int       fd;      // file being read
+	PageID    pid;     // page being read
+	Count     bucket;  // index in bucket list that page belongs to
+	Page      page;    // buffer for page contents
+	struct iovec iov;  // for io_uring readv
+} Slot;
+
+// overflow page still to be requested
+typedef struct {
+	PageID pid;
+	Count  bucket;
+} Pending;
+
+#ifdef HAVE_IO_URING
+typedef struct {
+	int      fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void    *sqring, *cqring;
+	size_t  sqlen, cqlen, sqeslen;
+} Ring;
+#endif
+
+struct PrefetchRep {
+	int     datafd, ovfd;
+	Count   pagesize;
+	PageID  *buckets;   // candidate buckets, in scan order
+	Count   nbuckets;
+	Count   nextb;      // next bucket whose page is to be requested
+	Count   curb;       // bucket the scan is currently in
+	Slot    slots[PFDEPTH];
+	Pending *pending;   // overflow pages not yet requested
+	Count   npending, maxpending;
+	Count   ninflight;  // # slots QUEUED or LOADING
+	pthread_mutex_t lock;
+	pthread_cond_t  changed;
+	Bool    useRing;
+#ifdef HAVE_IO_URING
+	Ring    ring;
+#endif
+	pthread_t threads[PFTHREADS];
+	Bool    stopping;
+};
+
+#ifdef HAVE_IO_URING
+
+// set up an io_uring with PFDEPTH entries; FALSE if not possible
+
+static Bool ringSetup(Ring *r)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, PFDEPTH, &p);
+	if (r->fd < 0) return FALSE;
+	r->sqlen = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	r->cqlen = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cqlen > r->sqlen) r->sqlen = r->cqlen;
+		r->cqlen = r->sqlen;
+	}
+	r->sqring = mmap(NULL, r->sqlen, PROT_READ|PROT_WRITE,
+	                 MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sqring == MAP_FAILED) { close(r->fd); return FALSE; }
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cqring = r->sqring;
+	else {
+		r->cqring = mmap(NULL, r->cqlen, PROT_READ|PROT_WRITE,
+		                 MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cqring == MAP_FAILED) {
+			munmap(r->sqring, r->sqlen); close(r->fd); return FALSE;
+		}
+	}
+	r->sqeslen = p.sq_entries*sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqeslen, PROT_READ|PROT_WRITE,
+	               MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		if (r->cqring != r->sqring) munmap(r->cqring, r->cqlen);
+		munmap(r->sqring, r->sqlen); close(r->fd); return FALSE;
+	}
+	char *sq = r->sqring, *cq = r->cqring;
+	r->sqhead = (unsigned *)(sq + p.sq_off.head);
+	r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+	r->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sqarray = (unsigned *)(sq + p.sq_off.array);
+	r->cqhead = (unsigned *)(cq + p.cq_off.head);
+	r->cqtail = (unsigned *)(cq + p.cq_off.tail);
+	r->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return TRUE;
+}
+
+static void ringClose(Ring *r)
+{
+	munmap(r->sqes, r->sqeslen);
+	if (r->cqring != r->sqring) munmap(r->cqring, r->cqlen);
+	munmap(r->sqring, r->sqlen);
+	close(r->fd);
+}
+
+// queue a read of slot i's page and tell the kernel about it
+// at most PFDEPTH reads are ever outstanding, so the SQ can't fill
+
+static void ringSubmit(Prefetch pf, int i)
+{
+	Ring *r = &pf->ring;
+	Slot *s = &pf->slots[i];
+	unsigned tail = *r->sqtail;
+	unsigned idx = tail & *r->sqmask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	s->iov.iov_base = s->page;
+	s->iov.iov_len = pf->pagesize;
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = s->fd;
+	sqe->addr = (unsigned long)&s->iov;
+	sqe->len = 1;
+	sqe->off = (off_t)s->pid * pf->pagesize;
+	sqe->user_data = i;
+	r->sqarray[idx] = idx;
+	__atomic_store_n(r->sqtail, tail+1, __ATOMIC_RELEASE);
+	int n = syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+	assert(n == 1);
+}
+
+#endif
+
+// hand out free slots to overflow pages first, then primary pages
+
+static void fillSlots(Prefetch pf)
+{
+	int i;
+	for (i = 0; i < PFDEPTH; i++) {
+		Slot *s = &pf->slots[i];
+		if (s->state != FREE) continue;
+		if (pf->npending > 0) {
+			pf->npending--;
+			s->fd = pf->ovfd;
+			s->pid = pf->pending[0].pid;
+			s->bucket = pf->pending[0].bucket;
+			memmove(&pf->pending[0], &pf->pending[1],
+			        pf->npending*sizeof(Pending));
+		}
+		else if (pf->nextb < pf->nbuckets) {
+			s->fd = pf->datafd;
+			s->pid = pf->buckets[pf->nextb];
+			s->bucket = pf->nextb++;
+		}
+		else
+			return;
+		pf->ninflight++;
+#ifdef HAVE_IO_URING
+		if (pf->useRing) {
+			s->state = LOADING;
+			ringSubmit(pf, i);
+			continue;
+		}
+#endif
+		s->state = QUEUED;
+		pthread_cond_broadcast(&pf->changed);
+	}
+}
+
+// a read has finished; queue the page's overflow page, if wanted
+// called with pf->lock held
+
+static void loaded(Prefetch pf, int i, Bool ok)
+{
+	Slot *s = &pf->slots[i];
+	pf->ninflight--;
+	if (!ok || s->bucket < pf->curb) {
+		// failed or no longer wanted; scan will read it itself
+		s->state = FREE;
+		return;
+	}
+	s->state = READY;
+	PageID ov = pageOvflow(s->page);
+	if (ov != NO_PAGE) {
+		if (pf->npending == pf->maxpending) {
+			pf->maxpending = 2*pf->maxpending + 8;
+			pf->pending = realloc(pf->pending,
+			                      pf->maxpending*sizeof(Pending));
+			assert(pf->pending != NULL);
+		}
+		pf->pending[pf->npending].pid = ov;
+		pf->pending[pf->npending].bucket = s->bucket;
+		pf->npending++;
+	}
+}
+
+// collect finished reads; if wait, block until at least one finishes
+// called with pf->lock held
+
+static void reap(Prefetch pf, Bool wait)
+{
+#ifdef HAVE_IO_URING
+	if (pf->useRing) {
+		Ring *r = &pf->ring;
+		if (wait) {
+			int n = syscall(__NR_io_uring_enter, r->fd, 0, 1,
+			                IORING_ENTER_GETEVENTS, NULL, 0);
+			assert(n >= 0);
+		}
+		unsigned head = *r->cqhead;
+		while (head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cqmask];
+			loaded(pf, cqe->user_data, cqe->res == pf->pagesize);
+			head++;
+		}
+		__atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+		fillSlots(pf);
+		return;
+	}
+#endif
+	if (wait) pthread_cond_wait(&pf->changed, &pf->lock);
+	fillSlots(pf);
+}
+
+// fallback reader thread: take QUEUED slots and pread() them
+
+static void *reader(void *arg)
+{
+	Prefetch pf = arg;
+	int i;
+	pthread_mutex_lock(&pf->lock);
+	while (!pf->stopping) {
+		for (i = 0; i < PFDEPTH; i++)
+			if (pf->slots[i].state == QUEUED) break;
+		if (i == PFDEPTH) {
+			pthread_cond_wait(&pf->changed, &pf->lock);
+			continue;
+		}
+		Slot *s = &pf->slots[i];
+		s->state = LOADING;
+		pthread_mutex_unlock(&pf->lock);
+		ssize_t n = pread(s->fd, s->page, pf->pagesize,
+		                  (off_t)s->pid * pf->pagesize);
+		pthread_mutex_lock(&pf->lock);
+		loaded(pf, i, n == pf->pagesize);
+		fillSlots(pf);
+		pthread_cond_broadcast(&pf->changed);
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return NULL;
+}
+
+// start reading the pages of buckets[0..nb-1]
+// both files must have the same page size
+
+Prefetch startPrefetch(int datafd, int ovfd, PageID *buckets, Count nb)
+{
+	int i;
+	Prefetch new = malloc(sizeof(struct PrefetchRep));
+	assert(new != NULL);
+	new->datafd = datafd;
+	new->ovfd = ovfd;
+	new->pagesize = filePageSize(datafd);
+	assert(filePageSize(ovfd) == new->pagesize);
+	new->buckets = buckets;
+	new->nbuckets = nb;
+	new->nextb = new->curb = 0;
+	new->pending = NULL;
+	new->npending = new->maxpending = 0;
+	new->ninflight = 0;
+	new->stopping = FALSE;
+	for (i = 0; i < PFDEPTH; i++) {
+		new->slots[i].state = FREE;
+		new->slots[i].page = allocPage(new->pagesize);
+	}
+	pthread_mutex_init(&new->lock, NULL);
+	pthread_cond_init(&new->changed, NULL);
+	new->useRing = FALSE;
+#ifdef HAVE_IO_URING
+	new->useRing = ringSetup(&new->ring);
+#endif
+	if (!new->useRing) {
+		for (i = 0; i < PFTHREADS; i++) {
+			int err = pthread_create(&new->threads[i], NULL, reader, new);
+			assert(err == 0);
+		}
+	}
+	pthread_mutex_lock(&new->lock);
+	fillSlots(new);
+	pthread_mutex_unlock(&new->lock);
+	return new;
+}
+
+static int findSlot(Prefetch pf, int fd, PageID pid, Count bi)
+{
+	int i;
+	for (i = 0; i < PFDEPTH; i++) {
+		Slot *s = &pf->slots[i];
+		if (s->state != FREE && s->state != INUSE && s->fd == fd &&
+		    s->pid == pid && s->bucket == bi)
+			return i;
+	}
+	return -1;
+}
+
+// get page pid of fd, which the scan needs for bucket bi
+// must be given back via prefetchDone()
+
+Page prefetchPage(Prefetch pf, Count bi, int fd, PageID pid)
+{
+	int i;
+	pthread_mutex_lock(&pf->lock);
+	if (bi > pf->curb) {
+		// scan has moved on; drop what's left of earlier buckets
+		pf->curb = bi;
+		for (i = 0; i < PFDEPTH; i++) {
+			Slot *s = &pf->slots[i];
+			if (s->state == READY && s->bucket < bi) s->state = FREE;
+		}
+		Count j, n = 0;
+		for (j = 0; j < pf->npending; j++)
+			if (pf->pending[j].bucket >= bi)
+				pf->pending[n++] = pf->pending[j];
+		pf->npending = n;
+	}
+	reap(pf, FALSE);
+	while ((i = findSlot(pf, fd, pid, bi)) >= 0 &&
+	       pf->slots[i].state != READY)
+		reap(pf, TRUE);
+	Page p;
+	if (i >= 0) {
+		pf->slots[i].state = INUSE;
+		p = pf->slots[i].page;
+	}
+	else {
+		// not requested (yet); don't wait for it
+		Count j, n = 0;
+		for (j = 0; j < pf->npending; j++)
+			if (pf->pending[j].pid != pid || fd != pf->ovfd)
+				pf->pending[n++] = pf->pending[j];
+		pf->npending = n;
+		p = allocPage(pf->pagesize);
+		readPage(fd, pid, p);
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return p;
+}
+
+// the scan has finished with a page from prefetchPage()
+
+void prefetchDone(Prefetch pf, Page p)
+{
+	int i;
+	pthread_mutex_lock(&pf->lock);
+	for (i = 0; i < PFDEPTH; i++)
+		if (pf->slots[i].page == p) break;
+	if (i < PFDEPTH) {
+		assert(pf->slots[i].state == INUSE);
+		pf->slots[i].state = FREE;
+		fillSlots(pf);
+	}
+	else
+		freePage(p);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+char *prefetchMethod(Prefetch pf)
+{
+	return pf->useRing ? "io_uring" : "threads";
+}
+
+// wait for outstanding reads, then release everything
+
+void endPrefetch(Prefetch pf)
+{
+	int i;
+	pthread_mutex_lock(&pf->lock);
+	pf->curb = pf->nextb = pf->nbuckets;
+	pf->npending = 0;
+	while (pf->ninflight > 0) reap(pf, TRUE);
+	pf->stopping = TRUE;
+	pthread_cond_broadcast(&pf->changed);
+	pthread_mutex_unlock(&pf->lock);
+	if (!pf->useRing) {
+		for (i = 0; i < PFTHREADS; i++)
+			pthread_join(pf->threads[i], NULL);
+	}
+#ifdef HAVE_IO_URING
+	else
+		ringClose(&pf->ring);
+#endif
+	for (i = 0; i < PFDEPTH; i++) freePage(pf->slots[i].page);
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->changed);
+	free(pf->pending);
+	free(pf);
+}
@@ -0,0 +1,22 @@
+// prefetch.h ... interface to asynchronous page prefetching
+// part of Multi-attribute Linear-hashed Files
+// See prefetch.c for details of the Prefetch type and functions
+
+#ifndef PREFETCH_H
+#define PREFETCH_H 1
+
+typedef struct PrefetchRep *Prefetch;
+
+#include "defs.h"
+#include "page.h"
+
+#define PFDEPTH   32  // max # pages queued or in flight
+#define PFTHREADS 4   // reader threads, if io_uring unavailable
+
+Prefetch startPrefetch(int datafd, int ovfd, PageID *buckets, Count nb);
+Page prefetchPage(Prefetch, Count bi, int fd, PageID pid);
+void prefetchDone(Prefetch, Page);
+char *prefetchMethod(Prefetch);
+void endPrefetch(Prefetch);
+
+#endif
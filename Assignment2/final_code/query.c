@@ -3,11 +3,30 @@
 // Manage creating and using Query objects
 // Last modified by John Shepherd, July 2019
 
+#include <unistd.h>
 #include "defs.h"
 #include "query.h"
 #include "reln.h"
 #include "tuple.h"
 #include "hash.h"
+#include "bits.h"
+#include "chvec.h"
+#include "buffer.h"
+#include "prefetch.h"
+#include "scan.h"
+
+// Planning
+// A query either probes its candidate buckets, following each one's
+//   overflow chain, or sweeps the whole relation with a Scan (see
+//   scan.c): the data file's bucket pages, then the overflow file
+// startQuery() picks whichever costs less, counting a page read
+//   while probing as RANDPAGE and one read by a sweep as SEQPAGE,
+//   and taking each bucket to have the relation's average # pages
+// Only read-only, non-concurrent relations are swept, since a sweep
+//   reads the files directly, without locks or the buffer pool
+
+#define SEQPAGE  1.0  // relative cost of reading a page in a sweep
+#define RANDPAGE 4.0  // relative cost of reading a page in a probe
 
 // A suggestion ... you can change however you like
 
@@ -17,169 +36,549 @@ struct QueryRep {
 	Bits    unknown;   // the unknown bits from MAH
 	PageID  curpage;   // current page in scan
 	int     is_ovflow; // are we in the overflow pages?
-	Offset  curtup;    // offset of current tuple within page
+	Count   curtup;    // index of next tuple (slot) within page
 	//TODO
-	Tuple query_tuple; //query tuple
-	Bits current_hash; //current hash value
+	Pred  pred;        //compiled query tuple
+	PageID *buckets;   //candidate buckets, in increasing order
+	Count  nbuckets;   //# candidate buckets
+	Count  curbucket;  //index in buckets[] of bucket being scanned
+	Prefetch pf;       //reads buckets ahead of the scan, or NULL
+	Page   page;       //current page, pinned between calls (or NULL)
+	// for relations opened in "c" mode, alongside a writer
+	Count  maxbuckets; //size of buckets[]
+	Count  nseen;      //buckets in the relation when last checked
+	Byte  *covered;    //bucket b was scanned at level covered[b]-1
+	Count  ncovered;   //size of covered[]
+	PageID locked;     //bucket locked for the scan, or NO_PAGE
+	// the plan
+	Bool   sweep;      //sweep the files, rather than probe buckets?
+	double probecost;  //estimated cost of each plan
+	double sweepcost;
+	Scan   scan;       //does the sweep, or NULL
+	// what the scan has done so far; see queryStats()
+	Count  nprimary;   //primary pages read
+	Count  novflow;    //overflow pages read
+	Count  nexamined;  //live tuples checked against pred
+	Count  nmatched;   //tuples that matched
 };
 
-// take a query string (e.g. "1234,?,abc,?")
-// set up a QueryRep object for the scan
+static int cmpPageID(const void *a, const void *b)
+{
+	PageID x = *(PageID *)a, y = *(PageID *)b;
+	return (x > y) - (x < y);
+}
 
-Query startQuery(Reln r, char *q)
+// list the distinct buckets that could hold tuples whose hash
+//   agrees with known on every bit not set in unknown
+// buckets below the split pointer sp use d+1 hash bits, others d
+// enumerates subsets of the unknown bits among the lower d bits;
+//   bit d only matters for buckets that have already been split
+// result is malloc'd and sorted; *nb is set to its length
+
+PageID *candidateBuckets(Bits known, Bits unknown, Count d, Count sp,
+                         Count *nb)
 {
-	Query new = malloc(sizeof(struct QueryRep));
-	assert(new != NULL);
-	// TODO
-	// Partial algorithm:
-	Tuple t = q;
-	Count nvals = nattrs(r);
-	char **vals = malloc(nvals*sizeof(char *));
-	Bits composite_hashes[nvals];
-	tupleVals(t, vals);
+	Bits lowmask = (d >= 32) ? ~0u : (1u << d) - 1;
+	Bits topbit = (d >= 32) ? 0 : (1u << d);
+	Bits u = unknown & lowmask;
+	Bits k = known & ~unknown & lowmask;
+	Count n = 0, max = 1;
+	Bits s;
+	for (s = u; s != 0; s &= s-1) max *= 2;
+	if (unknown & topbit) max *= 2;
+	PageID *b = malloc(max * sizeof(PageID));
+	assert(b != NULL);
+	s = 0;
+	do {
+		Bits h = k | s;
+		if (h < sp) {
+			// bucket split already; bit d picks h or its buddy
+			if (unknown & topbit) {
+				b[n++] = h;
+				b[n++] = h | topbit;
+			}
+			else
+				b[n++] = h | (known & topbit);
+		}
+		else
+			b[n++] = h;
+		s = (s - u) & u;
+	} while (s != 0);
+	qsort(b, n, sizeof(PageID), cmpPageID);
+	*nb = n;
+	return b;
+}
+
+// how many buckets candidateBuckets() would list, without listing them
+// every subset of the lower unknown bits gives one bucket, and those
+//   below sp give a second one if bit d is also unknown
+// counts the subsets below sp a bit at a time, from bit d-1 down
 
+Count candidateCount(Bits known, Bits unknown, Count d, Count sp)
+{
+	Bits lowmask = (d >= 32) ? ~0u : (1u << d) - 1;
+	Bits topbit = (d >= 32) ? 0 : (1u << d);
+	Bits u = unknown & lowmask;
+	Bits k = known & ~unknown & lowmask;
+	Count n = 1, nfree = 0, nbelow = 0;
 	int i;
-	for(i=0;i<nvals;i++){
-		//printf("%d: %s\n", i, vals[i]);
-		if(strcmp(vals[i], "?") == 0){
-			// form unknown bits from '?' attributes
-			composite_hashes[i] = 0;
-		}else{
-			// form known bits from known attributes
-			composite_hashes[i] = hash_any((unsigned char *)vals[i],strlen(vals[i]));
+	for (i = 0; i < 32; i++)
+		if (u & (1u << i)) n *= 2;
+	if (!(unknown & topbit)) return n;
+	// walk down from bit d-1 while h matches sp's bits so far
+	for (i = (int)d-1; i >= 0; i--) {
+		Bits bit = 1u << i, sbit = sp & bit;
+		if (u & bit) {
+			// taking 0 where sp has 1 puts every lower choice below sp
+			nfree++;
+			if (sbit) nbelow += n >> nfree;
+		}
+		else if ((k & bit) != sbit) {
+			if (sbit) nbelow += n >> nfree;
+			return n + nbelow;
 		}
 	}
-	//Setting known and unknown
-	ChVecItem *cv = chvec(r);
+	return n + nbelow;
+}
+
+// take a query string (e.g. "1234,?,abc,?")
+// set up a QueryRep object for the scan
+
+// form known bits from known attributes of a (valid) query
+// form unknown bits from '?' attributes
+// uses the same compiled choice vector as tupleHash()
+
+static void queryBits(Reln r, char *q, Bits *kp, Bits *up)
+{
+	ChVecMap *map = chvecMap(r);
 	Bits known = 0;
 	Bits unknown = 0;
-	for(i=0;i<MAXCHVEC;i++){
-		Byte a = cv[i].att;
-		Byte b = cv[i].bit;
-
-		if(bitIsSet(composite_hashes[a], b)){
-			known = setBit(known, i);
-		}
-		if(strcmp(vals[a], "?") == 0){
-			unknown = setBit(unknown, i);
-		}
+	Count a = 0;
+	char *c = q, *c0 = q;
+	for (;;) {
+		while (*c != ',' && *c != '\0') c++;
+		if (*c0 == '?')
+			unknown |= map[a].mask;
+		else
+			known |= chvecApply(&map[a], hash_any((unsigned char *)c0, c-c0));
+		a++;
+		if (*c == '\0') break;
+		c++; c0 = c;
 	}
+	*kp = known;
+	*up = unknown;
+}
+
+// the buckets that could hold answers to a (valid) query
 
-	// compute PageID of first page
-	//   using known bits and first "unknown" value
-	Bits p = getLower(known, depth(r)) < splitp(r) 
-	? getLower(known, depth(r) + 1) 
-	: getLower(known, depth(r));
+PageID *queryBuckets(Reln r, char *q, Count *nb)
+{
+	Bits known, unknown;
+	queryBits(r, q, &known, &unknown);
+	return candidateBuckets(known, unknown, depth(r), splitp(r), nb);
+}
+
+// estimate the cost of probing and of sweeping, and pick one
+
+static void planQuery(Query q)
+{
+	Reln r = q->rel;
+	Count np = npages(r);
+	Count ovpages = lseek(ovflowFile(r), 0, SEEK_END) / pagesize(r);
+	double chain = (double)(np + novused(r)) / np;
+	q->probecost = q->nbuckets * chain * RANDPAGE;
+	q->sweepcost = (np + ovpages) * SEQPAGE;
+	q->sweep = (q->sweepcost < q->probecost && !writableRelation(r)
+	            && !concurrentRelation(r));
+	q->scan = q->sweep ? startScan(r) : NULL;
+}
+
+// make q probe its candidate buckets, whatever was planned
+// should be called before the scan starts
+
+void probeQuery(Query q)
+{
+	if (!q->sweep) return;
+	closeScan(q->scan);
+	q->scan = NULL;
+	q->sweep = FALSE;
+}
+
+Query startQuery(Reln r, char *q)
+{
+	// compile the query once, for matching candidate tuples
+	Pred pred = compilePred(r, q);
+	if (pred == NULL) return NULL;
+	Query new = malloc(sizeof(struct QueryRep));
+	assert(new != NULL);
+	Bits known, unknown;
+	queryBits(r, q, &known, &unknown);
 
 	// set all values in QueryRep object
 	new->rel = r;
 	new->known = known;
 	new->unknown = unknown;
-	new->curpage = p;
 	new->is_ovflow = 0;
 	new->curtup = 0;
-	new->query_tuple = q;
-	new->current_hash = known;
-	freeVals(vals, nvals);
+	new->pred = pred;
+
+	// a writer may have added buckets since the relation was opened
+	refreshRelation(r);
+
+	// work out every bucket the scan needs to visit
+	// the list could also be used to prefetch pages
+	new->buckets = candidateBuckets(known, unknown, depth(r), splitp(r),
+	                                &new->nbuckets);
+	new->curbucket = 0;
+	new->curpage = new->buckets[0];
+	new->pf = NULL;
+	new->page = NULL;
+	new->maxbuckets = new->nbuckets;
+	new->nseen = npages(r);
+	new->covered = NULL;
+	new->ncovered = 0;
+	new->locked = NO_PAGE;
+	planQuery(new);
+	new->nprimary = new->novflow = 0;
+	new->nexamined = new->nmatched = 0;
 	return new;
 }
 
-// get next tuple during a scan
+// read the query's candidate buckets asynchronously, ahead of the scan
+// should be called before the scan starts
+// not worth doing for mapped relations, whose pages are already there
 
-Tuple getNextTuple(Query q)
+void prefetchQuery(Query q)
 {
-	// TODO
-	// Partial algorithm:
-	Page page;
-	while(TRUE){
-		//Get current page.
-		if(q->is_ovflow == 0){
-			page = getPage(dataFile(q->rel), q->curpage);
-		}else{
-			page = getPage(ovflowFile(q->rel), q->curpage);
+	int data = dataFile(q->rel), ovflow = ovflowFile(q->rel);
+	if (q->pf != NULL || q->sweep || isMappedFile(data)) return;
+	// buckets can be added to the scan as it runs
+	if (concurrentRelation(q->rel)) return;
+	// prefetched pages bypass the buffer pool
+	flushPages(data);
+	flushPages(ovflow);
+	q->pf = startPrefetch(data, ovflow, q->buckets, q->nbuckets);
+}
+
+// page access for the scan, via the prefetcher if there is one
+// the current page stays pinned in q->page until the scan moves off it
+
+static void fetchPage(Query q)
+{
+	int fd = q->is_ovflow ? ovflowFile(q->rel) : dataFile(q->rel);
+	if (q->is_ovflow) q->novflow++; else q->nprimary++;
+	if (q->pf != NULL)
+		q->page = prefetchPage(q->pf, q->curbucket, fd, q->curpage);
+	else if (q->locked != NO_PAGE) {
+		// the writer's pages are in its own buffer pool, and have
+		// been written through; ours could be stale
+		q->page = allocPage(pagesize(q->rel));
+		readPage(fd, q->curpage, q->page);
+	}
+	else
+		q->page = getPage(fd, q->curpage);
+}
+
+static void donePage(Query q)
+{
+	if (q->pf != NULL)
+		prefetchDone(q->pf, q->page);
+	else if (q->locked != NO_PAGE)
+		freePage(q->page);
+	else
+		releasePage(q->page);
+	q->page = NULL;
+}
+
+// Scanning while another process inserts (relation in "c" mode)
+// Each bucket is scanned under a shared lock, at the level (# hash
+//   bits) it had at the time.  A bucket scanned at level k holds all
+//   tuples whose hash agrees with it on the low k bits, so a bucket
+//   created later by splitting it need not be scanned; one created
+//   by splitting a bucket not yet scanned must be added to the scan.
+
+static Count bucketLevel(Reln r, PageID b)
+{
+	Count d = depth(r);
+	if (b >= (1u << d) || b < splitp(r)) return d+1;
+	return d;
+}
+
+static Bool isCovered(Query q, PageID b)
+{
+	Count k, lev = bucketLevel(q->rel, b);
+	for (k = 0; k <= lev; k++) {
+		PageID a = (k == 0) ? 0 : b & ((1u << k) - 1);
+		if (a < q->ncovered && q->covered[a] == k+1) return TRUE;
+	}
+	return FALSE;
+}
+
+// add buckets created since the last check that the query needs
+
+static void addNewBuckets(Query q)
+{
+	Count n = npages(q->rel);
+	PageID b;
+	for (b = q->nseen; b < n; b++) {
+		Bits mask = (1u << bucketLevel(q->rel, b)) - 1;
+		if (((b ^ q->known) & ~q->unknown & mask) != 0) continue;
+		if (isCovered(q, b)) continue;
+		if (q->nbuckets == q->maxbuckets) {
+			q->maxbuckets *= 2;
+			q->buckets = realloc(q->buckets, q->maxbuckets*sizeof(PageID));
+			assert(q->buckets != NULL);
 		}
-		Offset offset = pageFreeSpace(page);
-		if(q->curtup < offset){
-			// if (more tuples in current page)
-			//    get next matching tuple from current page
-			while(q->curtup < offset){
-				Tuple t = getPageTuple(page, q->curtup);
-				if(tupleMatch(q->rel, t, q->query_tuple)){
-					q->curtup += tupLength(t) + 1;
-					Tuple result = malloc(strlen(t)*sizeof(Tuple));
-					strcpy(result, t);
-					free(page);
-					return result;
-				}
-				q->curtup += tupLength(t) + 1;
-			}
-			free(page);
+		q->buckets[q->nbuckets++] = b;
+	}
+	q->nseen = n;
+}
+
+// lock the current bucket; FALSE if it need not be scanned
+
+static Bool startBucket(Query q)
+{
+	PageID b = q->buckets[q->curbucket];
+	if (isCovered(q, b)) return FALSE;
+	lockBucket(q->rel, b);
+	q->locked = b;
+	if (refreshRelation(q->rel)) addNewBuckets(q);
+	return TRUE;
+}
+
+static void endBucket(Query q)
+{
+	PageID b = q->locked;
+	if (b >= q->ncovered) {
+		Count n = q->ncovered;
+		q->ncovered = (b < 2*n) ? 2*n : b+1;
+		q->covered = realloc(q->covered, q->ncovered);
+		assert(q->covered != NULL);
+		memset(q->covered+n, 0, q->ncovered-n);
+	}
+	q->covered[b] = bucketLevel(q->rel, b) + 1;
+	unlockBucket(q->rel, b);
+	q->locked = NO_PAGE;
+	if (refreshRelation(q->rel)) addNewBuckets(q);
+}
+
+// find the next matching tuple in the current page, and set m to it
+
+static Bool matchInPage(Query q, Match *m)
+{
+	Count ntups = pageNTuples(q->page);
+	while (q->curtup < ntups) {
+		Count i = q->curtup++;
+		if (!pageTupleLive(q->page, i)) continue;
+		Tuple t = pageTuple(q->page, i);
+		q->nexamined++;
+		if (predMatch(q->pred, t)) {
+			q->nmatched++;
+			m->tup = t;
+			m->len = pageTupleLen(q->page, i);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// advance a sweep to the next matching tuple, and set m to it
+// pages the sweep has passed stay valid until it reads more of the
+//   files, so with stay it can still move on to another page
+
+static Bool sweepNext(Query q, Match *m, Bool stay)
+{
+	for (;;) {
+		if (q->page != NULL && matchInPage(q, m)) return TRUE;
+		Page pg = nextScanPage(q->scan, stay);
+		if (pg == NULL) return FALSE;
+		q->page = pg;
+		q->curtup = 0;
+	}
+}
+
+// advance the scan to the next matching tuple, and set m to it
+// if stay, give up rather than leave the current page
+
+static Bool scanNext(Query q, Match *m, Bool stay)
+{
+	if (q->sweep) return sweepNext(q, m, stay);
+	Bool conc = concurrentRelation(q->rel);
+	while (q->curbucket < q->nbuckets) {
+		if (conc && q->locked == NO_PAGE && !startBucket(q)) {
+			q->curbucket++;
+			if (q->curbucket < q->nbuckets)
+				q->curpage = q->buckets[q->curbucket];
 			continue;
 		}
-		if(pageOvflow(page) != NO_PAGE){
-			// else if (current page has overflow)
-			//    move to overflow page
-			//    grab first matching tuple from page
-			q->curpage = pageOvflow(page);
-			q->curtup = 0;
+		if (q->page == NULL) fetchPage(q);
+		// if (more tuples in current page)
+		//    get next matching tuple from current page
+		if (matchInPage(q, m)) return TRUE;
+		if (stay) return FALSE;
+		// else if (current page has overflow)
+		//    move to overflow page
+		// else
+		//    move to next candidate bucket
+		PageID ov = pageOvflow(q->page);
+		donePage(q);
+		q->curtup = 0;
+		if (ov != NO_PAGE) {
+			q->curpage = ov;
 			q->is_ovflow = 1;
-			free(page);
-			continue;
-		}else{
-			// else
-			//    move to "next" bucket
-			//    grab first matching tuple from data page
-			free(page);
-			page = NULL;
-
-			int d = splitp(q->rel) > 0 ? depth(q->rel) + 1 :depth(q->rel);
-			Bits mask = (1<<d) - 1;
-			Bool flag = FALSE;
-			if((mask & q->unknown) != 0){
-				q->current_hash = q->current_hash & mask;
-				q->known = q->known & mask;
-				q->unknown = q->unknown & mask;
-
-				if(q->current_hash != (q->known | q->unknown)){
-					Bits bit;
-					for(bit = q->current_hash + 1;bit<=(q->known | q->unknown);bit++){
-						Bits new_bit = (bit & q->unknown) | q->known;
-						if(new_bit != q->current_hash){
-							q->current_hash = new_bit;
-							q->curtup = 0;
-							q->is_ovflow = 0;
-
-							Bits p = getLower(new_bit, depth(q->rel));
-							if(p<splitp(q->rel)){
-								p = getLower(new_bit, depth(q->rel)+1);
-							}
-							if(p != q->curpage){
-								q->curpage = p;
-								flag = TRUE;
-								break;
-							}
-						}
-					}
-				}
-			}
-			if(flag){
-				continue;
-			}else{
-				break;
-			}
+		}
+		else {
+			if (conc) endBucket(q);
+			q->curbucket++;
+			if (q->curbucket < q->nbuckets)
+				q->curpage = q->buckets[q->curbucket];
+			q->is_ovflow = 0;
 		}
 	}
-	// if (current page has no matching tuples)
-	//    go to next page (try again)
-	// endif
-	if(page != NULL) free(page);
-	return NULL;
+	return FALSE;
+}
+
+// get next matching tuple, as a pointer into its page
+// m is only valid until the next call on q, or closeQuery(q)
+
+Bool nextMatch(Query q, Match *m)
+{
+	return scanNext(q, m, FALSE);
+}
+
+// get up to max matching tuples, all from the same page
+// returns # matches found; 0 means the scan is finished
+// the matches are only valid until the next call on q
+
+Count nextMatches(Query q, Match *m, Count max)
+{
+	Count n = 0;
+	if (max == 0 || !scanNext(q, &m[n++], FALSE)) return 0;
+	while (n < max && scanNext(q, &m[n], TRUE)) n++;
+	return n;
+}
+
+// get next tuple during a scan, as a malloc'd copy
+
+Tuple getNextTuple(Query q)
+{
+	Match m;
+	if (!nextMatch(q, &m)) return NULL;
+	Tuple t = malloc(m.len+1);
+	assert(t != NULL);
+	memcpy(t, m.tup, m.len+1);
+	return t;
+}
+
+// Parallel scans (see select -j)
+// scanBucket() scans one candidate bucket by itself, reading its pages
+//   into the caller's buffer (or from the mapping, if the files are
+//   mapped), so several threads can scan different buckets of q at
+//   once, without the buffer pool's lock
+// the relation must not be changing; counts are added atomically
+
+Count queryNBuckets(Query q) { return q->nbuckets; }
+
+void scanBucket(Query q, Count bi, Page buf,
+                void (*found)(void *arg, Match *m), void *arg)
+{
+	Reln r = q->rel;
+	assert(!writableRelation(r) && !concurrentRelation(r));
+	int fd = dataFile(r);
+	PageID pid = q->buckets[bi];
+	Count nprimary = 0, novflow = 0, nexamined = 0, nmatched = 0;
+	while (pid != NO_PAGE) {
+		Page pg = buf;
+		if (isMappedFile(fd))
+			pg = getPage(fd, pid);
+		else
+			readPage(fd, pid, buf);
+		if (fd == dataFile(r)) nprimary++; else novflow++;
+		Count i, n = pageNTuples(pg);
+		for (i = 0; i < n; i++) {
+			if (!pageTupleLive(pg, i)) continue;
+			Match m;
+			m.tup = pageTuple(pg, i);
+			nexamined++;
+			if (!predMatch(q->pred, m.tup)) continue;
+			nmatched++;
+			m.len = pageTupleLen(pg, i);
+			found(arg, &m);
+		}
+		pid = pageOvflow(pg);
+		fd = ovflowFile(r);
+	}
+	__atomic_add_fetch(&q->nprimary, nprimary, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&q->novflow, novflow, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&q->nexamined, nexamined, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&q->nmatched, nmatched, __ATOMIC_RELAXED);
+}
+
+// show how q will be answered: the hash bits it knows, among the
+//   d+1 that the file uses, and the candidate buckets, each with its
+//   # primary + # overflow pages
+// finds the overflow page counts by following each bucket's chain
+
+void explainQuery(Query q)
+{
+	Reln r = q->rel;
+	Count d = depth(r), nbits = (d >= 31) ? 32 : d+1;
+	Bits mask = (nbits == 32) ? ~0u : (1u << nbits) - 1;
+	char buf[MAXBITS+5];
+	printf("depth=%d  sp=%d  #buckets=%d  hash bits used=%d\n", d,
+	       splitp(r), npages(r), nbits);
+	bitsString(q->known & ~q->unknown & mask, buf);
+	printf("known:    %s\n", buf);
+	bitsString(q->unknown & mask, buf);
+	printf("unknown:  %s\n", buf);
+	printf("plan: %s  (est. cost: probe %.0f, sweep %.0f)\n",
+	       q->sweep ? "sweep data then overflow file" : "probe buckets",
+	       q->probecost, q->sweepcost);
+	printf("candidate buckets (primary+overflow pages):");
+	Count i, nov = 0;
+	for (i = 0; i < q->nbuckets; i++) {
+		Page pg = getPage(dataFile(r), q->buckets[i]);
+		PageID ov = pageOvflow(pg);
+		releasePage(pg);
+		Count n = 0;
+		while (ov != NO_PAGE) {
+			pg = getPage(ovflowFile(r), ov);
+			ov = pageOvflow(pg);
+			releasePage(pg);
+			n++;
+		}
+		nov += n;
+		if (i % 8 == 0) printf("\n ");
+		printf(" %7d+%d", q->buckets[i], n);
+	}
+	printf("\n%d buckets: %d primary + %d overflow = %d pages\n",
+	       q->nbuckets, q->nbuckets, nov, q->nbuckets+nov);
+}
+
+// show what the scan of q has done so far, and how pages were
+//   prefetched, if they were
+
+void queryStats(Query q)
+{
+	if (q->sweep) scanStats(q->scan, &q->nprimary, &q->novflow);
+	printf("pages read: %d primary + %d overflow = %d\n", q->nprimary,
+	       q->novflow, q->nprimary+q->novflow);
+	printf("tuples examined: %d  matched: %d\n", q->nexamined,
+	       q->nmatched);
+	if (q->pf != NULL)
+		printf("pages prefetched via: %s\n", prefetchMethod(q->pf));
 }
 
 // clean up a QueryRep object and associated data
 
 void closeQuery(Query q)
 {
-	// TODO
+	if (q->page != NULL && !q->sweep) donePage(q);
+	if (q->scan != NULL) closeScan(q->scan);
+	if (q->locked != NO_PAGE) unlockBucket(q->rel, q->locked);
+	if (q->pf != NULL) endPrefetch(q->pf);
+	free(q->covered);
+	freePred(q->pred);
+	free(q->buckets);
 	free(q);
 }
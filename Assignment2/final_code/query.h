@@ -11,8 +11,27 @@ typedef struct QueryRep *Query;
 #include "reln.h"
 #include "tuple.h"
 
+// a matching tuple, still inside the page that holds it
+typedef struct {
+	Tuple tup;  // '\0'-terminated tuple
+	Count len;  // # chars, excluding '\0'
+} Match;
+
 Query startQuery(Reln, char *);
 Tuple getNextTuple(Query);
+Bool nextMatch(Query, Match *);
+Count nextMatches(Query, Match *, Count max);
+void prefetchQuery(Query);
+void probeQuery(Query);
+Count queryNBuckets(Query);
+void scanBucket(Query, Count bi, Page buf,
+                void (*found)(void *arg, Match *m), void *arg);
+void explainQuery(Query);
+void queryStats(Query);
 void closeQuery(Query);
+PageID *candidateBuckets(Bits known, Bits unknown, Count d, Count sp,
+                         Count *nb);
+Count candidateCount(Bits known, Bits unknown, Count d, Count sp);
+PageID *queryBuckets(Reln r, char *q, Count *nb);
 
 #endif
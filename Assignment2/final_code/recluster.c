@@ -0,0 +1,56 @@
+// recluster.c ... give a relation a new choice vector
+// part of Multi-attribute linear-hashed files
+// Rebuilds a named relation so its tuples are placed by a new
+//   choice vector, then swaps the new files in for the old
+// Usage:  ./recluster  [-v]  [-M MB]  RelName  ChoiceVector
+// where ChoiceVector = attr,bit:attr,bit:... (as for create,
+//   or as printed by advise)
+// -M sets how many MB of tuples may be held in memory (default 256)
+// Queries may run meanwhile; inserts, deletes and updates wait
+//   until it has finished
+
+#include "defs.h"
+#include "reln.h"
+
+#define USAGE "./recluster  [-v]  [-M MB]  RelName  ChoiceVector"
+#define BULKMEM 256  // default MB of tuples held in memory
+
+// Main ... process args, recluster
+
+int main(int argc, char **argv)
+{
+	char err[2*MAXERRMSG];  // buffer for error messages
+	int verbose;  // show how many tuples were moved
+	int budget = BULKMEM;  // MB of tuples to hold in memory
+	char *rname;  // name of table/file
+	char *cv;     // new choice vector
+
+	// process command-line args
+
+	int a = 1;
+	verbose = 0;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-M") == 0 && a+1 < argc)
+			budget = atoi(argv[++a]);
+		else
+			fatal(USAGE);
+		a++;
+	}
+	if (argc - a < 2 || budget < 1) fatal(USAGE);
+	rname = argv[a];  cv = argv[a+1];
+
+	if (!existsRelation(rname)) {
+		sprintf(err, "No such relation: %s", rname);
+		fatal(err);
+	}
+	int n = reclusterRelation(rname, cv, (size_t)budget << 20);
+	if (n < 0) {
+		sprintf(err, "Can't recluster %s: invalid choice vector, or the"
+		        " relation is being logged", rname);
+		fatal(err);
+	}
+	if (verbose) printf("%d tuples reclustered\n", n);
+	return 0;
+}
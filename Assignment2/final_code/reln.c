@@ -2,6 +2,12 @@
 // part of Multi-attribute Linear-hashed Files
 // Last modified by John Shepherd, July 2019
 
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "defs.h"
 #include "reln.h"
 #include "page.h"
@@ -9,8 +15,13 @@
 #include "chvec.h"
 #include "bits.h"
 #include "hash.h"
+#include "buffer.h"
+#include "wal.h"
+#include "query.h"
 
 #define HEADERSIZE (3*sizeof(Count)+sizeof(Offset))
+#define NINFO 13 // # Count-sized fields at start of RelnRep saved in .info
+#define VERSION 12 // index of header version among the NINFO fields
 
 struct RelnRep {
 	Count  nattrs; // number of attributes
@@ -18,32 +29,208 @@ struct RelnRep {
 	Offset sp;     // split pointer
     Count  npages; // number of main data pages
     Count  ntups;  // total number of tuples
+	Count  pagesize; // bytes per page in data/ovflow files
+	PageID freeov; // first page in list of free overflow pages
+	Count  nfreeov; // # pages in that list
+	Count  novused; // # overflow pages in use (not free)
+	Count  nbytes; // space used by tuples (incl. slots) in all pages
+	Count  split;  // split policy (SPLIT_COUNT, SPLIT_LOAD, ...)
+	Count  splitarg; // policy's threshold, as a percentage
+	Count  version; // bumped twice each time the header is published
 	ChVec  cv;     // choice vector
+	ChVecMap *cvmap; // cv compiled for hashing, one map per attribute
 	char   mode;   // open for read/write
 	FILE  *info;   // handle on info file
-	FILE  *data;   // handle on data file
-	FILE  *ovflow; // handle on ovflow file
+	int    data;   // descriptor for data file
+	int    ovflow; // descriptor for ovflow file
+	// for inserts from several threads; see shareRelation()
+	Bool   shared; // is locking needed?
+	pthread_mutex_t lock;  // relation lock, for the fields above
+	pthread_mutex_t latches[NLATCHES];  // bucket p uses p % NLATCHES
+	Count  pendsplits; // splits due but not yet done
+	Bool   splitting;  // is some thread doing them?
+	// for readers running alongside a writer process; see below
+	Bool   concurrent; // opened with "c" mode?
+	Count *hdr;    // the NINFO header fields, mapped from .info
+	Wal    wal;    // log of inserts, or NULL; see logRelation()
 };
 
+// Locking, when several threads insert into a relation at once
+// - a bucket's pages are only touched under its latch
+// - the relation lock covers the header fields (depth, sp, counts,
+//   free list) and is only held briefly, never during bucket I/O
+// - a latch may be taken before the relation lock, never after
+// - splits are done one at a time, holding the latches of both
+//   buckets involved; sp moves on before the latches are released,
+//   so an inserter that waited on a latch re-checks its bucket
+
+static void lockReln(Reln r)
+{
+	if (r->shared) pthread_mutex_lock(&r->lock);
+}
+
+static void unlockReln(Reln r)
+{
+	if (r->shared) pthread_mutex_unlock(&r->lock);
+}
+
+// Concurrency between processes, for relations opened in "c" mode
+// - the header fields in .info are mapped into every process, and
+//   published by the writer under a seqlock: version is odd while
+//   an update is in progress
+// - a bucket is locked via fcntl() on the first byte of its primary
+//   page; the writer holds an exclusive lock while it changes any
+//   page of the bucket, readers a shared one while they scan it
+// - the writer writes pages through to the files, and publishes the
+//   header, before it releases a bucket lock; a split is published
+//   before the old bucket is unlocked
+// - readers re-read the header after locking each bucket (see query.c)
+// - there is at most one writer: it holds an exclusive fcntl() lock on
+//   byte INFO_CWRITER of .info, taken without waiting when it opens
+// - a writer that died mid-publish leaves version odd; the next writer
+//   makes it even again, and readers that spin for MAXSPINS check
+//   whether any writer holds the lock, and carry on if none does
+
+#define INFO_CWRITER 2
+#define MAXSPINS     (1 << 20)
+// - with several inserting threads, pages are written through holding
+//   just a bucket latch; the relation lock is only taken to copy the
+//   header, so a split writes through before it moves sp on
+
+static void writeThrough(Reln r)
+{
+	if (!r->concurrent || r->mode != 'w') return;
+	flushPages(r->data);
+	flushPages(r->ovflow);
+}
+
+// the caller must not hold the relation lock
+
+static void publishHeader(Reln r)
+{
+	if (!r->concurrent || r->mode != 'w') return;
+	lockReln(r);
+	Count v = r->hdr[VERSION];
+	__atomic_store_n(&r->hdr[VERSION], v+1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int i;
+	for (i = 0; i < VERSION; i++)
+		__atomic_store_n(&r->hdr[i], ((Count *)r)[i], __ATOMIC_RELAXED);
+	__atomic_store_n(&r->hdr[VERSION], v+2, __ATOMIC_RELEASE);
+	r->version = v+2;
+	unlockReln(r);
+}
+
+// is some process writing r in "c" mode?
+
+static Bool writerAlive(Reln r)
+{
+	struct flock fl;
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = INFO_CWRITER;
+	fl.l_len = 1;
+	if (fcntl(fileno(r->info), F_GETLK, &fl) < 0)
+		fatal("Can't check for a writer");
+	return (fl.l_type != F_UNLCK);
+}
+
+// update a reader's copy of the header from the writer's
+// returns TRUE if it changed
+
+Bool refreshRelation(Reln r)
+{
+	Count buf[NINFO], v1, v2, spins = 0;
+	int i;
+	if (!r->concurrent || r->mode == 'w') return FALSE;
+	do {
+		while ((v1 = __atomic_load_n(&r->hdr[VERSION], __ATOMIC_ACQUIRE)) & 1) {
+			// the header is stable if its writer has gone
+			if (v1 == r->version) break;  // and we found that out already
+			if (++spins % MAXSPINS == 0 && !writerAlive(r)) break;
+		}
+		for (i = 0; i < VERSION; i++)
+			buf[i] = __atomic_load_n(&r->hdr[i], __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		v2 = __atomic_load_n(&r->hdr[VERSION], __ATOMIC_RELAXED);
+	} while (v1 != v2);
+	if (v1 == r->version) return FALSE;
+	memcpy(r, buf, VERSION*sizeof(Count));
+	r->version = v1;
+	return TRUE;
+}
+
+static void lockRange(Reln r, PageID p, short type)
+{
+	struct flock fl;
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (off_t)p * r->pagesize;
+	fl.l_len = 1;
+	while (fcntl(r->data, F_SETLKW, &fl) < 0) {
+		if (errno != EINTR) fatal("Can't lock bucket");
+	}
+}
+
+void lockBucket(Reln r, PageID p)
+{
+	if (r->concurrent) lockRange(r, p, r->mode == 'w' ? F_WRLCK : F_RDLCK);
+}
+
+void unlockBucket(Reln r, PageID p)
+{
+	if (r->concurrent) lockRange(r, p, F_UNLCK);
+}
+
+Bool concurrentRelation(Reln r) { return r->concurrent; }
+Bool writableRelation(Reln r) { return r->mode == 'w'; }
+
+// open a page file, using the same mode strings as fopen()
+// page files are accessed via pread/pwrite, so no stdio
+
+static int openPageFile(char *fname, char *mode)
+{
+	int flags;
+	if (mode[0] == 'w')
+		flags = O_RDWR|O_CREAT|O_TRUNC;
+	else if (mode[1] == '+')
+		flags = O_RDWR;
+	else
+		flags = O_RDONLY;
+	return open(fname, flags, 0644);
+}
+
 // create a new relation (three files)
 
-Status newRelation(char *name, Count nattrs, Count npages, Count d, char *cv)
+Status newRelation(char *name, Count nattrs, Count npages, Count d, char *cv,
+                   Count pagesize, Count split, Count splitarg)
 {
     char fname[MAXFILENAME];
 	Reln r = malloc(sizeof(struct RelnRep));
+	assert(r != NULL);
 	r->nattrs = nattrs; r->depth = d; r->sp = 0;
 	r->npages = npages; r->ntups = 0; r->mode = 'w';
-	assert(r != NULL);
+	r->pagesize = pagesize;
+	r->freeov = NO_PAGE; r->nfreeov = 0; r->novused = 0;
+	r->nbytes = 0; r->split = split; r->splitarg = splitarg;
+	r->version = 0;
+	r->shared = FALSE;
+	r->concurrent = FALSE;
+	r->hdr = NULL;
+	r->wal = NULL;
+	r->cvmap = NULL;
 	if (parseChVec(r, cv, r->cv) != OK) return ~OK;
 	sprintf(fname,"%s.info",name);
 	r->info = fopen(fname,"w");
 	assert(r->info != NULL);
 	sprintf(fname,"%s.data",name);
-	r->data = fopen(fname,"w");
-	assert(r->data != NULL);
+	r->data = openPageFile(fname,"w");
+	assert(r->data >= 0);
 	sprintf(fname,"%s.ovflow",name);
-	r->ovflow = fopen(fname,"w");
-	assert(r->ovflow != NULL);
+	r->ovflow = openPageFile(fname,"w");
+	assert(r->ovflow >= 0);
+	setPageSize(r->data, pagesize);
+	setPageSize(r->ovflow, pagesize);
 	int i;
 	for (i = 0; i < npages; i++) addPage(r->data);
 	closeRelation(r);
@@ -65,292 +252,1314 @@ Bool existsRelation(char *name)
 	}
 }
 
+// Re-clustering (see reclusterRelation()) builds a shadow relation,
+//   name~, then renames its files over the relation's
+// - the shadow is synced, then the marker file name.swap is created;
+//   from then on the swap will happen, so if the marker is found
+//   when the relation is opened, the swap is finished first
+// - the swap holds an exclusive lock on byte INFO_FILES of the old
+//   .info, and opening the files a shared one, so no process opens
+//   a mixture of old and new files; a process that had the old files
+//   open keeps reading them
+// - a process with the relation open for writing holds a shared lock
+//   on byte INFO_WRITERS until it closes it; re-clustering holds an
+//   exclusive one throughout, so it waits for writers to finish, and
+//   writers that open the relation meanwhile wait for it
+// fcntl() locks belong to the process, and closing any descriptor
+//   for .info drops them all; so they are taken via a descriptor
+//   kept open for as long as they are needed
+
+#define INFO_FILES   0
+#define INFO_WRITERS 1
+
+static void lockInfo(int fd, off_t which, short type)
+{
+	struct flock fl;
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = which;
+	fl.l_len = 1;
+	while (fcntl(fd, F_SETLKW, &fl) < 0) {
+		if (errno != EINTR) fatal("Can't lock relation info");
+	}
+}
+
+// is open file fd still the one called fname?
+
+static Bool sameFile(int fd, char *fname)
+{
+	struct stat a, b;
+	if (fstat(fd, &a) < 0 || stat(fname, &b) < 0) return FALSE;
+	return (a.st_dev == b.st_dev && a.st_ino == b.st_ino);
+}
+
+// make renames and creations in the relation's directory durable
+
+static void syncDir(char *name)
+{
+	char dir[MAXFILENAME];
+	strcpy(dir, name);
+	char *slash = strrchr(dir, '/');
+	if (slash == NULL) strcpy(dir, "."); else slash[1] = '\0';
+	int fd = open(dir, O_RDONLY);
+	if (fd < 0 || fsync(fd) < 0) fatal("Can't sync relation directory");
+	close(fd);
+}
+
+// rename whichever shadow files remain; .info goes last
+
+static void finishSwap(char *name)
+{
+	char *exts[] = { "data", "ovflow", "info" };
+	char from[MAXFILENAME], to[MAXFILENAME];
+	int i;
+	for (i = 0; i < 3; i++) {
+		sprintf(from, "%s~.%s", name, exts[i]);
+		sprintf(to, "%s.%s", name, exts[i]);
+		if (rename(from, to) < 0 && errno != ENOENT)
+			fatal("Can't swap in reclustered relation");
+	}
+	sprintf(from, "%s.swap", name);
+	unlink(from);
+	syncDir(name);
+}
+
 // set up a relation descriptor from relation name
 // open files, reads information from rel.info
+// mode "rm" is read-only, with page files accessed via mmap
+// mode "c" (e.g. "rc", "r+c") is for concurrent access; see above
 
-Reln openRelation(char *name, char *mode)
+static Reln openFiles(char *name, char *mode)
 {
 	Reln r;
 	r = malloc(sizeof(struct RelnRep));
 	assert(r != NULL);
+	// "m" and "c" are extras; strip them off for fopen()
+	Bool mapped = (strchr(mode, 'm') != NULL);
+	Bool concurrent = (strchr(mode, 'c') != NULL);
+	if (mode[0] == 'w')
+		mode = "w";
+	else
+		mode = (strchr(mode, '+') != NULL) ? "r+" : "r";
 	char fname[MAXFILENAME];
+	// retry if a recluster swapped .info before it could be locked
+	// writers wait for a recluster before locking the files, so that
+	//   they don't hold up its swap
+	Bool writer = (mode[0] == 'w' || mode[1] == '+');
 	sprintf(fname,"%s.info",name);
-	r->info = fopen(fname,mode);
-	assert(r->info != NULL);
+	for (;;) {
+		r->info = fopen(fname,mode);
+		assert(r->info != NULL);
+		if (writer) lockInfo(fileno(r->info), INFO_WRITERS, F_RDLCK);
+		lockInfo(fileno(r->info), INFO_FILES, F_RDLCK);
+		if (sameFile(fileno(r->info), fname)) break;
+		fclose(r->info);
+	}
 	sprintf(fname,"%s.data",name);
-	r->data = fopen(fname,mode);
-	assert(r->data != NULL);
+	r->data = openPageFile(fname,mode);
+	assert(r->data >= 0);
 	sprintf(fname,"%s.ovflow",name);
-	r->ovflow = fopen(fname,mode);
-	assert(r->ovflow != NULL);
+	r->ovflow = openPageFile(fname,mode);
+	assert(r->ovflow >= 0);
+	lockInfo(fileno(r->info), INFO_FILES, F_UNLCK);
+	if (mapped) {
+		mapPageFile(r->data);
+		mapPageFile(r->ovflow);
+	}
 	// Naughty: assumes Count and Offset are the same size
-	int n = fread(r, sizeof(Count), 5, r->info);
-	assert(n == 5);
+	int n = fread(r, sizeof(Count), NINFO, r->info);
+	assert(n == NINFO);
 	n = fread(r->cv, sizeof(ChVecItem), MAXCHVEC, r->info);
 	assert(n == MAXCHVEC);
+	r->cvmap = compileChVec(r->cv, r->nattrs);
+	setPageSize(r->data, r->pagesize);
+	setPageSize(r->ovflow, r->pagesize);
 	r->mode = (mode[0] == 'w' || mode[1] =='+') ? 'w' : 'r';
+	r->shared = FALSE;
+	r->concurrent = concurrent;
+	r->hdr = NULL;
+	r->wal = NULL;
+	if (concurrent && r->mode == 'w') {
+		struct flock fl;
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = INFO_CWRITER;
+		fl.l_len = 1;
+		if (fcntl(fileno(r->info), F_SETLK, &fl) < 0) {
+			char err[MAXFILENAME+MAXERRMSG];
+			sprintf(err, "Relation %s is being written by another process",
+			        name);
+			fatal(err);
+		}
+	}
+	if (concurrent) {
+		int prot = (r->mode == 'w') ? PROT_READ|PROT_WRITE : PROT_READ;
+		r->hdr = mmap(NULL, NINFO*sizeof(Count), prot, MAP_SHARED,
+		              fileno(r->info), 0);
+		assert(r->hdr != MAP_FAILED);
+		// header read above may have been mid-update
+		r->version = 0;
+		refreshRelation(r);
+		// a writer that died mid-publish left the version odd
+		if (r->mode == 'w' && (r->hdr[VERSION] & 1)) {
+			__atomic_store_n(&r->hdr[VERSION], r->hdr[VERSION]+1,
+			                 __ATOMIC_RELEASE);
+			r->version = r->hdr[VERSION];
+		}
+	}
 	return r;
 }
 
 // release files and descriptor for an open relation
 // copy latest information to .info file
 
+static void writeInfo(Reln r)
+{
+	fseek(r->info, 0, SEEK_SET);
+	// write out core relation info
+	// (#attr,d,sp,#pages,#tups,pagesize,freeov,#freeov,#ovused,
+	//  #bytes,split,splitarg,version)
+	int n = fwrite(r, sizeof(Count), NINFO, r->info);
+	assert(n == NINFO);
+	// write out choice vector
+	n = fwrite(r->cv, sizeof(ChVecItem), MAXCHVEC, r->info);
+	assert(n == MAXCHVEC);
+}
+
+// Logged inserts
+// While a relation is being logged (see wal.c), its page files and
+//   .info only change at checkpoints, which happen on close and
+//   whenever the log grows past WALMAX
+// With several inserting threads, a checkpoint is done by the thread
+//   doing splits, once it holds every bucket latch; each insert is
+//   logged before its latch is released, so the checkpoint sees
+//   every logged insert in the pages, and no others
+
+// bring the page files and .info up to date with the log
+
+void checkpointRelation(Reln r)
+{
+	if (r->wal == NULL) return;
+	flushPages(r->data);
+	flushPages(r->ovflow);
+	walCheckpoint(r->wal, (Count *)r, NINFO);
+	writeInfo(r);
+	fflush(r->info);
+	if (fsync(fileno(r->info)) < 0) fatal("Can't sync relation info");
+	walReset(r->wal);
+}
+
+// redo a logged update: its query, then the new tuples, one per line
+
+static void redoUpdate(Reln r, char *s)
+{
+	Count n = 0, max = 64;
+	Tuple *new = malloc(max*sizeof(Tuple));
+	assert(new != NULL);
+	char *q = s, *c = strchr(s, '\n');
+	while (c != NULL) {
+		*c++ = '\0';
+		if (n == max) {
+			max *= 2;
+			new = realloc(new, max*sizeof(Tuple));
+			assert(new != NULL);
+		}
+		new[n++] = c;
+		c = strchr(c, '\n');
+	}
+	if (updateRelation(r, q, new, n) < 0) fatal("Can't redo logged update");
+	free(new);
+}
+
+// redo the changes logged by a process that died
+// does nothing if there is no log, or its process is still running
+
+static void recoverRelation(char *name)
+{
+	Reln r = openFiles(name, "r+");
+	Count hdr[NINFO];
+	Bool done;
+	memcpy(hdr, r, NINFO*sizeof(Count));
+	r->wal = recoverWal(name, r->data, r->ovflow, hdr, NINFO, &done);
+	if (r->wal == NULL) {
+		// nothing changed; don't rewrite .info
+		r->mode = 'r';
+	}
+	else if (done)
+		memcpy(r, hdr, NINFO*sizeof(Count));
+	else {
+		char *s;
+		Count type;
+		while ((s = walNext(r->wal, &type)) != NULL) {
+			if (type == WAL_INSERT && addToRelation(r, s) == NO_PAGE)
+				fatal("Can't re-insert logged tuple");
+			if (type == WAL_DELETE && deleteFromRelation(r, s) < 0)
+				fatal("Can't redo logged delete");
+			if (type == WAL_UPDATE) redoUpdate(r, s);
+			free(s);
+		}
+	}
+	closeRelation(r);
+}
+
+Reln openRelation(char *name, char *mode)
+{
+	char fname[MAXFILENAME];
+	sprintf(fname,"%s.swap",name);
+	if (access(fname, F_OK) == 0) finishSwap(name);
+	sprintf(fname,"%s.wal",name);
+	if (access(fname, F_OK) == 0) recoverRelation(name);
+	return openFiles(name, mode);
+}
+
+// log all inserts into r, syncing the log every window inserts
+// returns FALSE if the relation is already being logged
+
+Bool logRelation(Reln r, char *name, Count window)
+{
+	assert(r->mode == 'w' && !r->concurrent && r->wal == NULL);
+	r->wal = newWal(name, r->data, r->ovflow, window);
+	return (r->wal != NULL);
+}
+
 void closeRelation(Reln r)
 {
 	// make sure updated global data is put in info
 	// Naughty: assumes Count and Offset are the same size
-	if (r->mode == 'w') {
-		fseek(r->info, 0, SEEK_SET);
-		// write out core relation info (#attr,#pages,d,sp)
-		int n = fwrite(r, sizeof(Count), 5, r->info);
-		assert(n == 5);
-		// write out choice vector
-		n = fwrite(r->cv, sizeof(ChVecItem), MAXCHVEC, r->info);
-		assert(n == MAXCHVEC);
+	if (r->wal != NULL) {
+		checkpointRelation(r);
+		closeWal(r->wal);
 	}
+	else if (r->mode == 'w')
+		writeInfo(r);
+	if (r->hdr != NULL) munmap(r->hdr, NINFO*sizeof(Count));
+	dropPages(r->data);
+	dropPages(r->ovflow);
+	unmapPageFile(r->data);
+	unmapPageFile(r->ovflow);
 	fclose(r->info);
-	fclose(r->data);
-	fclose(r->ovflow);
+	close(r->data);
+	close(r->ovflow);
+	free(r->cvmap);
+	if (r->shared) {
+		int i;
+		pthread_mutex_destroy(&r->lock);
+		for (i = 0; i < NLATCHES; i++)
+			pthread_mutex_destroy(&r->latches[i]);
+	}
 	free(r);
 }
 
+// allow several threads to insert into r at once
+// via addToRelationShared(); other functions are not thread-safe
+
+void shareRelation(Reln r)
+{
+	int i;
+	assert(!r->shared && r->mode == 'w');
+	pthread_mutex_init(&r->lock, NULL);
+	for (i = 0; i < NLATCHES; i++)
+		pthread_mutex_init(&r->latches[i], NULL);
+	r->pendsplits = 0;
+	r->splitting = FALSE;
+	r->shared = TRUE;
+}
+
+// overflow pages no longer in any chain are kept in a free list
+// - the list is linked through the pages' ovflow fields
+// - its head and length are saved in the .info file
+// new overflow pages come from the list before the file is extended
+
+static PageID newOvflowPage(Reln r)
+{
+	lockReln(r);
+	r->novused++;
+	PageID pid = r->freeov;
+	if (pid == NO_PAGE)
+		pid = addPage(r->ovflow);
+	else {
+		Page pg = getPage(r->ovflow, pid);
+		r->freeov = pageOvflow(pg);
+		r->nfreeov--;
+		releasePage(pg);
+		putPage(r->ovflow, pid, newPage(r->pagesize));
+	}
+	unlockReln(r);
+	return pid;
+}
+
+static void freeOvflowPage(Reln r, PageID pid)
+{
+	lockReln(r);
+	Page pg = newPage(r->pagesize);
+	pageSetOvflow(pg, r->freeov);
+	putPage(r->ovflow, pid, pg);
+	r->freeov = pid;
+	r->nfreeov++;
+	r->novused--;
+	unlockReln(r);
+}
+
+// add a tuple to bucket p; returns p, or NO_PAGE if it can't be done
+// only the primary page and the chain's tail page ever take tuples
+// the primary page records where the tail is and how much room it
+//   has, so there is no walk along the chain
+
+static PageID addToBucket(Reln r, PageID p, Tuple t)
+{
+	Page pg = getPage(r->data, p);
+	if (addToPage(pg, t) == OK) {
+		putPage(r->data, p, pg);
+		return p;
+	}
+	// primary data page full; try the end of the chain
+	PageID tail = pageTail(pg);
+	if (tail != NO_PAGE && pageTailFree(pg) >= pageTupleSpace(t)) {
+		Page tailpg = getPage(r->ovflow, tail);
+		Status ok = addToPage(tailpg, t);
+		assert(ok == OK);
+		pageSetTail(pg, tail, pageFreeSpace(tailpg));
+		putPage(r->ovflow, tail, tailpg);
+		putPage(r->data, p, pg);
+		return p;
+	}
+	// no room anywhere; add a new page to the end of the chain
+	PageID newp = newOvflowPage(r);
+	Page newpg = getPage(r->ovflow, newp);
+	if (addToPage(newpg, t) != OK) {
+		// can't add to a new page; we have a problem
+		releasePage(newpg);
+		releasePage(pg);
+		return NO_PAGE;
+	}
+	if (tail == NO_PAGE)
+		pageSetOvflow(pg, newp);
+	else {
+		Page tailpg = getPage(r->ovflow, tail);
+		pageSetOvflow(tailpg, newp);
+		putPage(r->ovflow, tail, tailpg);
+	}
+	pageSetTail(pg, newp, pageFreeSpace(newpg));
+	putPage(r->ovflow, newp, newpg);
+	putPage(r->data, p, pg);
+	return p;
+}
+
+// fraction of the primary pages' tuple space that is in use
+// over 1.0 means the tuples no longer fit without overflow pages
+
+static double loadFactor(Reln r)
+{
+	return (double)r->nbytes / ((double)r->npages*pageCapacity(r->pagesize));
+}
+
+// should the next insert be preceded by a split?
+// - SPLIT_COUNT: after every pagesize/(10*nattrs) inserts, as originally
+// - SPLIT_LOAD: when the load factor exceeds splitarg%
+// - SPLIT_OVFLOW: when there are more than splitarg overflow pages
+//   in use per 100 primary pages
+
+static Bool needSplit(Reln r)
+{
+	switch (r->split) {
+	case SPLIT_LOAD:
+		return (100.0*loadFactor(r) > r->splitarg);
+	case SPLIT_OVFLOW:
+		return ((double)100.0*r->novused > (double)r->splitarg*r->npages);
+	default:
+		return ((r->ntups+1) % (r->pagesize/(10*r->nattrs)) == 0);
+	}
+}
+
+// which bucket does a tuple with hash h belong in?
+
+static PageID bucketOf(Reln r, Bits h)
+{
+	if (r->depth == 0) return 0;
+	PageID p = getLower(h, r->depth);
+	if (p < r->sp) p = getLower(h, r->depth+1);
+	return p;
+}
+
+// move the split pointer on, after bucket sp has been split
+
+static void advanceSplitPointer(Reln r)
+{
+	r->npages++;
+	r->sp++;
+	if (r->sp == (1u << r->depth)) {
+		r->depth++;
+		r->sp = 0;
+	}
+}
+
+// insert a new tuple into a relation, without logging it
+
+static PageID insertTuple(Reln r, Tuple t)
+{
+	if (needSplit(r)) splitRelation(r);
+
+	PageID p = bucketOf(r, tupleHash(r,t));
+	lockBucket(r, p);
+	if (addToBucket(r, p, t) == NO_PAGE) {
+		unlockBucket(r, p);
+		return NO_PAGE;
+	}
+	r->ntups++;
+	r->nbytes += pageTupleSpace(t);
+	writeThrough(r);
+	publishHeader(r);
+	unlockBucket(r, p);
+	return p;
+}
+
 // insert a new tuple into a relation
 // returns index of bucket where inserted
 // - index always refers to a primary data page
 // - the actual insertion page may be either a data page or an overflow page
 // returns NO_PAGE if insert fails completely
-// TODO: include splitting and file expansion
 
 PageID addToRelation(Reln r, Tuple t)
 {
-	int num_tup = r->ntups + 1;
-	int split_or_not = num_tup % (1024/(10*r->nattrs));
-	if (split_or_not == 0){
+	PageID p = insertTuple(r, t);
+	if (p != NO_PAGE && r->wal != NULL) {
+		walInsert(r->wal, t);
+		if (walFull(r->wal)) checkpointRelation(r);
+	}
+	return p;
+}
+
+// do any splits that are due, unless another thread is doing them
+// then checkpoint, if the log is full; holding every latch, in order,
+//   stops the other threads' inserts meanwhile
+
+static void doPendingSplits(Reln r)
+{
+	lockReln(r);
+	if (r->splitting) { unlockReln(r); return; }
+	r->splitting = TRUE;
+	// count rule is checked per insert; others depend on current state
+	while (r->pendsplits > 0 || (r->split != SPLIT_COUNT && needSplit(r))) {
+		if (r->pendsplits > 0) r->pendsplits--;
+		unlockReln(r);
 		splitRelation(r);
+		lockReln(r);
 	}
-	
-	Bits h, p;
-	// char buf[MAXBITS+1];
-	h = tupleHash(r,t);
-	if (r->depth == 0)
-		p = 1;
-	else {
-		p = getLower(h, r->depth);
-		if (p < r->sp) p = getLower(h, r->depth+1);
-	}
-	// bitsString(h,buf); printf("hash = %s\n",buf);
-	// bitsString(p,buf); printf("page = %s\n",buf);
-	Page pg = getPage(r->data,p);
-	if (addToPage(pg,t) == OK) {
-		putPage(r->data,p,pg);
-		r->ntups++;
-		return p;
+	unlockReln(r);
+	if (r->wal != NULL && walFull(r->wal)) {
+		int i;
+		for (i = 0; i < NLATCHES; i++) pthread_mutex_lock(&r->latches[i]);
+		checkpointRelation(r);
+		for (i = NLATCHES-1; i >= 0; i--)
+			pthread_mutex_unlock(&r->latches[i]);
 	}
-	// primary data page full
-	if (pageOvflow(pg) == NO_PAGE) {
-		// add first overflow page in chain
-		PageID newp = addPage(r->ovflow);
-		pageSetOvflow(pg,newp);
-		putPage(r->data,p,pg);
-		Page newpg = getPage(r->ovflow,newp);
-		// can't add to a new page; we have a problem
-		if (addToPage(newpg,t) != OK) return NO_PAGE;
-		putPage(r->ovflow,newp,newpg);
+	lockReln(r);
+	r->splitting = FALSE;
+	unlockReln(r);
+}
+
+// insert a tuple with hash h, from one of several threads
+// splits happen after inserts rather than before, but the count rule
+//   still gives the same number of splits as addToRelation()
+
+PageID addToRelationShared(Reln r, Tuple t, Bits h)
+{
+	assert(r->shared);
+	PageID p;
+	pthread_mutex_t *latch;
+	for (;;) {
+		lockReln(r);
+		p = bucketOf(r, h);
+		unlockReln(r);
+		latch = &r->latches[p % NLATCHES];
+		pthread_mutex_lock(latch);
+		// the bucket may have been split while we waited
+		lockReln(r);
+		PageID again = bucketOf(r, h);
+		unlockReln(r);
+		if (again == p) break;
+		pthread_mutex_unlock(latch);
+	}
+	lockBucket(r, p);
+	PageID res = addToBucket(r, p, t);
+	if (res != NO_PAGE) {
+		lockReln(r);
+		if (r->split == SPLIT_COUNT && needSplit(r)) r->pendsplits++;
 		r->ntups++;
-		return p;
+		r->nbytes += pageTupleSpace(t);
+		unlockReln(r);
+		writeThrough(r);
+		publishHeader(r);
 	}
-	else {
-		// scan overflow chain until we find space
-		// worst case: add new ovflow page at end of chain
-		Page ovpg, prevpg = NULL;
-		PageID ovp, prevp = NO_PAGE;
-		ovp = pageOvflow(pg);
-		while (ovp != NO_PAGE) {
-			ovpg = getPage(r->ovflow, ovp);
-			if (addToPage(ovpg,t) != OK) {
-				prevp = ovp; prevpg = ovpg;
-				ovp = pageOvflow(ovpg);
-			}
-			else {
-				if (prevpg != NULL) free(prevpg);
-				putPage(r->ovflow,ovp,ovpg);
-				r->ntups++;
-				return p;
-			}
+	unlockBucket(r, p);
+	if (res != NO_PAGE && r->wal != NULL) walInsert(r->wal, t);
+	pthread_mutex_unlock(latch);
+	if (res == NO_PAGE) return NO_PAGE;
+	doPendingSplits(r);
+	return p;
+}
+
+// tuples taken out of a bucket during a split, kept in memory
+// all tuple strings live in one growing buffer, located by offset
+
+typedef struct {
+	char   *buf;   // tuple strings, each '\0'-terminated
+	size_t  used, size;
+	size_t *offs;  // offset of each tuple in buf
+	Count   ntups, max;
+} TupleList;
+
+static void initTupleList(TupleList *l)
+{
+	l->used = l->ntups = 0;
+	l->size = 4096; l->max = 64;
+	l->buf = malloc(l->size);
+	l->offs = malloc(l->max * sizeof(size_t));
+	assert(l->buf != NULL && l->offs != NULL);
+}
+
+static void appendTuple(TupleList *l, Tuple t, Count len)
+{
+	while (l->used + len + 1 > l->size) {
+		l->size *= 2;
+		l->buf = realloc(l->buf, l->size);
+		assert(l->buf != NULL);
+	}
+	if (l->ntups == l->max) {
+		l->max *= 2;
+		l->offs = realloc(l->offs, l->max * sizeof(size_t));
+		assert(l->offs != NULL);
+	}
+	memcpy(l->buf + l->used, t, len+1);
+	l->offs[l->ntups++] = l->used;
+	l->used += len+1;
+}
+
+static void freeTupleList(TupleList *l)
+{
+	free(l->buf);
+	free(l->offs);
+}
+
+// write a list of tuples out as a dense chain starting at data page pid
+// overflow pages are taken from spare[] (a stack) before the free
+//   list; *nspare is updated to show how many remain
+// the primary page is written last, once the tail is known
+
+static void writeChain(Reln r, PageID pid, TupleList *l,
+                       PageID *spare, Count *nspare)
+{
+	Page prim = newPage(r->pagesize);
+	Page pg = prim;
+	PageID cur = pid;
+	Count i;
+	for (i = 0; i < l->ntups; i++) {
+		Tuple t = l->buf + l->offs[i];
+		if (addToPage(pg, t) == OK) continue;
+		// page full; link to a fresh overflow page and carry on
+		PageID next = (*nspare > 0) ? spare[--(*nspare)]
+		                            : newOvflowPage(r);
+		pageSetOvflow(pg, next);
+		if (pg != prim) putPage(r->ovflow, cur, pg);
+		cur = next;
+		pg = newPage(r->pagesize);
+		if (addToPage(pg, t) != OK) fatal("Tuple too large for page");
+	}
+	if (pg != prim) {
+		pageSetTail(prim, cur, pageFreeSpace(pg));
+		putPage(r->ovflow, cur, pg);
+	}
+	putPage(r->data, pid, prim);
+}
+
+// overflow pages freed up while a bucket's chain is rewritten
+// they are handed out again in chain order, before the free list
+
+typedef struct {
+	PageID *pid;  // stack of pages
+	Count   n, max;
+} Spares;
+
+static void initSpares(Spares *s)
+{
+	s->n = 0; s->max = 16;
+	s->pid = malloc(s->max * sizeof(PageID));
+	assert(s->pid != NULL);
+}
+
+static void pushSpare(Spares *s, PageID pid)
+{
+	if (s->n == s->max) {
+		s->max *= 2;
+		s->pid = realloc(s->pid, s->max * sizeof(PageID));
+		assert(s->pid != NULL);
+	}
+	s->pid[s->n++] = pid;
+}
+
+// put the spares in the order they were pushed, top first
+
+static void orderSpares(Spares *s)
+{
+	Count i;
+	for (i = 0; i < s->n/2; i++) {
+		PageID tmp = s->pid[i];
+		s->pid[i] = s->pid[s->n-1-i];
+		s->pid[s->n-1-i] = tmp;
+	}
+}
+
+// whatever is left is no longer used
+
+static void freeSpares(Reln r, Spares *s)
+{
+	Count i;
+	for (i = 0; i < s->n; i++) freeOvflowPage(r, s->pid[i]);
+	free(s->pid);
+}
+
+// read the live tuples in bucket p into lo, or into hi if hi is
+//   not NULL and bit d of the tuple's hash is set
+// the bucket's overflow pages become spares
+
+static void loadChain(Reln r, PageID p, Count d, TupleList *lo,
+                      TupleList *hi, Spares *s)
+{
+	int fd = r->data;
+	PageID pid = p;
+	while (pid != NO_PAGE) {
+		Page pg = getPage(fd, pid);
+		Count i, n = pageNTuples(pg);
+		for (i = 0; i < n; i++) {
+			if (!pageTupleLive(pg, i)) continue;
+			Tuple t = pageTuple(pg, i);
+			TupleList *l = lo;
+			if (hi != NULL && (tupleHash(r, t) >> d) & 1) l = hi;
+			appendTuple(l, t, pageTupleLen(pg, i));
 		}
-		// all overflow pages are full; add another to chain
-		// at this point, there *must* be a prevpg
-		assert(prevpg != NULL);
-		// make new ovflow page
-		PageID newp = addPage(r->ovflow);
-		// insert tuple into new page
-		Page newpg = getPage(r->ovflow,newp);
-        if (addToPage(newpg,t) != OK) return NO_PAGE;
-        putPage(r->ovflow,newp,newpg);
-		// link to existing overflow chain
-		pageSetOvflow(prevpg,newp);
-		putPage(r->ovflow,prevp,prevpg);
-        r->ntups++;
-		return p;
+		PageID next = pageOvflow(pg);
+		releasePage(pg);
+		fd = r->ovflow; pid = next;
+		if (pid != NO_PAGE) pushSpare(s, pid);
 	}
-	return NO_PAGE;
 }
 
+// split bucket sp into buckets sp and sp+2^depth
+// the whole chain is read once and its tuples partitioned in memory
+//   by hash bit depth; both buckets are then written out densely,
+//   re-using the old chain's overflow pages
+// overflow pages not needed by either chain go on the free list
+
 void splitRelation(Reln r)
 {
-	addPage(r->data);
-	r->npages++;
-	//PageID addid = pid | setBit(0,r->depth);
+	lockReln(r);
+	PageID oldp = r->sp;
+	Count d = r->depth;
+	unlockReln(r);
+	PageID newp = oldp | (1u << d);
+	pthread_mutex_t *l1 = NULL, *l2 = NULL;
+	if (r->shared) {
+		// lowest-numbered latch first, to avoid deadlock
+		l1 = &r->latches[oldp % NLATCHES];
+		l2 = &r->latches[newp % NLATCHES];
+		if (l2 < l1) { pthread_mutex_t *tmp = l1; l1 = l2; l2 = tmp; }
+		pthread_mutex_lock(l1);
+		if (l2 != l1) pthread_mutex_lock(l2);
+	}
+	lockBucket(r, oldp);
+	// the page may be left from a bucket removed by contraction
+	if (lseek(r->data, 0, SEEK_END) / r->pagesize <= newp) {
+		PageID pid = addPage(r->data);
+		assert(pid == newp);
+	}
 
-	//Dummy approach to store all the tups stay in original page
-	Tuple *new_tup = malloc(1024 * sizeof(Tuple));
+	// load the old chain, noting its overflow pages for re-use
+	TupleList stay, move;
+	initTupleList(&stay);
+	initTupleList(&move);
+	Spares spare;
+	initSpares(&spare);
+	loadChain(r, oldp, d, &stay, &move, &spare);
+	orderSpares(&spare);
 
-	PageID pid = r->sp;
-	FILE * data = r->data;
-	int index = 0;
-	Offset cur_tup = 0;
-	Count num_tups = 0;
+	writeChain(r, oldp, &stay, spare.pid, &spare.n);
+	writeChain(r, newp, &move, spare.pid, &spare.n);
+	freeSpares(r, &spare);
+	freeTupleList(&stay);
+	freeTupleList(&move);
+	writeThrough(r);
+	lockReln(r);
+	advanceSplitPointer(r);
+	unlockReln(r);
+	publishHeader(r);
+	unlockBucket(r, oldp);
+	if (r->shared) {
+		if (l2 != l1) pthread_mutex_unlock(l2);
+		pthread_mutex_unlock(l1);
+	}
+}
 
-	while (pid != NO_PAGE){
-		Page page = getPage(data, pid);
+// Deletion
+// Tuples are deleted by marking them dead in their pages; the space
+//   is reclaimed when an insert needs it (see addToPage()), or when
+//   the bucket is next rewritten by a split or contraction
+// Overflow pages left with no live tuples are taken out of their
+//   chains at once, and go on the free list
+// When deletes leave the load factor below a threshold, the most
+//   recent splits are undone (contraction); the threshold is half the
+//   target load for SPLIT_LOAD, and CONTRACTLOAD for other policies
 
-		if(pageNTuples(page) == 0){
-			break;
-		}
+#define CONTRACTLOAD 40
+
+// move the split pointer back, undoing advanceSplitPointer()
+
+static void retreatSplitPointer(Reln r)
+{
+	r->npages--;
+	if (r->sp == 0) {
+		r->depth--;
+		r->sp = 1u << r->depth;
+	}
+	r->sp--;
+}
+
+// should the last split be undone?
+
+static Bool needContract(Reln r)
+{
+	if (r->npages <= 1) return FALSE;
+	Count low = (r->split == SPLIT_LOAD) ? r->splitarg/2 : CONTRACTLOAD;
+	// judge by the load the relation would have afterwards
+	double load = (double)r->nbytes /
+	              ((double)(r->npages-1)*pageCapacity(r->pagesize));
+	return (100.0*load < low);
+}
+
+// merge the last bucket back into the one it was split from
+// both chains are rewritten as one, re-using their overflow pages
+// the last bucket's data page is left in the file, for the next split
+
+static void contractRelation(Reln r)
+{
+	PageID last = r->npages-1;
+	retreatSplitPointer(r);
+	PageID into = r->sp;
+	assert((into | (1u << r->depth)) == last);
+
+	TupleList all;
+	initTupleList(&all);
+	Spares spare;
+	initSpares(&spare);
+	loadChain(r, into, 0, &all, NULL, &spare);
+	loadChain(r, last, 0, &all, NULL, &spare);
+	orderSpares(&spare);
+	writeChain(r, into, &all, spare.pid, &spare.n);
+	freeSpares(r, &spare);
+	freeTupleList(&all);
+}
 
-		Tuple tmp = nextTuple(data, pid, cur_tup);
-		Bits hash;
-		Bits newid;
-		hash = tupleHash(r, tmp);
-		newid = getLower(hash, r->depth + 1);
-		//if tuple should stay in original page
-		if (newid == pid){
-			new_tup[index++] = copyString(tmp);
-		} else {
-			//insert tuple in new page
-			if(tmp[0] == '1' && tmp[1] == '0' && tmp[2] == '8' && tmp[3] == '0')
-				printf("Tmp: %s, new id: %d\n",tmp, newid);
-			printf("Tmp: %s, new id: %d\n",tmp, newid);
-			PageID new_page = reScheduleRelation(r, tmp, newid);
-			if (new_page == NO_PAGE)
-				printf("No Page\n");
+// delete the tuples in bucket p that match pred
+// returns # deleted
+
+static Count deleteFromBucket(Reln r, PageID p, Pred pred)
+{
+	Page prim = getPage(r->data, p);
+	Bool primDirty = FALSE;
+	Page prev = NULL;  // page before pg in the chain, if not prim
+	PageID prevpid = NO_PAGE;
+	Bool prevDirty = FALSE;
+	Page pg = prim;
+	PageID pid = p;
+	Count ndel = 0;
+	for (;;) {
+		Count i, n = pageNTuples(pg), before = ndel;
+		for (i = 0; i < n; i++) {
+			if (!pageTupleLive(pg, i)) continue;
+			Tuple t = pageTuple(pg, i);
+			if (!predMatch(pred, t)) continue;
+			r->nbytes -= pageTupleSpace(t);
+			r->ntups--;
+			pageDeleteTuple(pg, i);
+			ndel++;
 		}
-		cur_tup += strlen(tmp)+1;
-		num_tups++;
-
-		if (num_tups >= pageNTuples(page)){
-			Page cover = newPage();
-			putPage(data, pid, cover);
-			pid = pageOvflow(page);
-			num_tups = 0;
-			cur_tup = 0;
-			data = r->ovflow;
-			printf("Move to overflow %d\n",pid);
+		Bool dirty = (ndel > before);
+		PageID next = pageOvflow(pg);
+		if (pg == prim) {
+			primDirty = dirty;
 		}
-		free(tmp);
-		free(page);
+		else if (pageNLive(pg) == 0) {
+			// unlink the empty page from the chain
+			pageSetOvflow((prev != NULL) ? prev : prim, next);
+			if (prev != NULL) prevDirty = TRUE; else primDirty = TRUE;
+			if (next == NO_PAGE) {
+				if (prev == NULL)
+					pageSetTail(prim, NO_PAGE, 0);
+				else
+					pageSetTail(prim, prevpid, pageFreeSpace(prev));
+				primDirty = TRUE;
+			}
+			releasePage(pg);
+			freeOvflowPage(r, pid);
+		}
+		else {
+			if (dirty && next == NO_PAGE) {
+				pageSetTail(prim, pid, pageFreeSpace(pg));
+				primDirty = TRUE;
+			}
+			if (prev != NULL) {
+				if (prevDirty) putPage(r->ovflow, prevpid, prev);
+				else releasePage(prev);
+			}
+			prev = pg; prevpid = pid; prevDirty = dirty;
+		}
+		if (next == NO_PAGE) break;
+		pid = next;
+		pg = getPage(r->ovflow, pid);
+	}
+	if (prev != NULL) {
+		if (prevDirty) putPage(r->ovflow, prevpid, prev);
+		else releasePage(prev);
 	}
+	if (primDirty) putPage(r->data, p, prim); else releasePage(prim);
+	return ndel;
+}
 
-	int i;
-	for (i = 0; i < index; i++){
-		Tuple tmp = new_tup[i];
-		if (reScheduleRelation(r, tmp, r->sp) == NO_PAGE)
-			printf("Alarm!!!!!  Inserting [%s] to page %d go wrong\n", tmp, r->sp);
-		free(tmp);
+// delete all tuples matching query q, without logging it
+// returns # deleted, or -1 if q is not a valid query
+
+static int deleteTuples(Reln r, char *q)
+{
+	assert(r->mode == 'w' && !r->shared && !r->concurrent);
+	Pred pred = compilePred(r, q);
+	if (pred == NULL) return -1;
+	Count i, nb, ndel = 0;
+	PageID *buckets = queryBuckets(r, q, &nb);
+	for (i = 0; i < nb; i++) ndel += deleteFromBucket(r, buckets[i], pred);
+	free(buckets);
+	freePred(pred);
+	while (needContract(r)) contractRelation(r);
+	return ndel;
+}
+
+// delete all tuples matching query q
+// returns # deleted, or -1 if q is not a valid query
+
+int deleteFromRelation(Reln r, char *q)
+{
+	int ndel = deleteTuples(r, q);
+	if (r->wal != NULL && ndel > 0) {
+		walDelete(r->wal, q);
+		if (walFull(r->wal)) checkpointRelation(r);
 	}
+	return ndel;
+}
 
-	free(new_tup);
-	if (getLower(r->sp + 1, r->depth) != 0){
-		r->sp++;
-	} else{
-		r->depth++;
-		r->sp = 0;
+// replace the tuples matching query q by new[0..n-1]
+// logged as one change, so after a crash, either all of it is
+//   redone or none of it; there is no checkpoint part way through
+// returns # deleted, or -1 if q is not a valid query
+
+int updateRelation(Reln r, char *q, Tuple *new, Count n)
+{
+	int ndel = deleteTuples(r, q);
+	if (ndel < 0) return -1;
+	Count i;
+	for (i = 0; i < n; i++) {
+		if (insertTuple(r, new[i]) == NO_PAGE)
+			fatal("Can't insert updated tuple");
 	}
+	if (r->wal != NULL && (ndel > 0 || n > 0)) {
+		walUpdate(r->wal, q, new, n);
+		if (walFull(r->wal)) checkpointRelation(r);
+	}
+	return ndel;
 }
 
+// add a tuple to bucket pid, without counting it or splitting
+
 PageID reScheduleRelation(Reln r, Tuple t, PageID pid)
 {
-	//debug
-	//printf("Start Inserting [%s] to page %d", t, pid);
-	Page pg = getPage(r->data,pid);
+	return addToBucket(r, pid, t);
+}
+
+// Bulk loading
+// All input tuples are read first, while working out when incremental
+//   inserts would have split; this fixes the final depth, sp, #pages
+// Tuples are then sorted by final bucket (a stable counting sort),
+//   and each bucket's pages are built in memory and written once,
+//   directly, bypassing the buffer pool
+// Each bucket gets the same tuples as with incremental inserts,
+//   in input order, packed densely
+// If the input outgrows the memory budget, tuples are spilled to
+//   temp files, radix-partitioned on the low bits of their hash;
+//   each partition then holds a disjoint set of buckets
+
+#define MAXPARTBITS 8
+
+typedef struct {
+	TupleList tl;      // tuple strings
+	Bits     *hashes;  // hash of each tuple in tl
+	Count     maxh;
+} BulkList;
+
+static void initBulkList(BulkList *b)
+{
+	initTupleList(&b->tl);
+	b->maxh = b->tl.max;
+	b->hashes = malloc(b->maxh * sizeof(Bits));
+	assert(b->hashes != NULL);
+}
 
-	if (addToPage(pg, t) == OK)
-	{
-		putPage(r->data, pid, pg);
-		return pid;
+static void appendBulk(BulkList *b, Tuple t, Count len, Bits h)
+{
+	if (b->tl.ntups == b->maxh) {
+		b->maxh *= 2;
+		b->hashes = realloc(b->hashes, b->maxh * sizeof(Bits));
+		assert(b->hashes != NULL);
 	}
-	// primary data page full
-	if (pageOvflow(pg) == NO_PAGE)
-	{
-		// add first overflow page in chain
-		PageID newp = addPage(r->ovflow);
-		pageSetOvflow(pg, newp);
-		putPage(r->data, pid, pg);
-		Page newpg = getPage(r->ovflow, newp);
-		// can't add to a new page; we have a problem
-		if (addToPage(newpg, t) != OK)
-			return NO_PAGE;
-		putPage(r->ovflow, newp, newpg);
-		return pid;
-	} else
-	{
-		// scan overflow chain until we find space
-		// worst case: add new ovflow page at end of chain
-		Page ovpg, prevpg = NULL;
-		PageID ovp, prevp = NO_PAGE;
-		ovp = pageOvflow(pg);
-		while (ovp != NO_PAGE)
-		{
-			ovpg = getPage(r->ovflow, ovp);
-			if (addToPage(ovpg, t) != OK)
-			{
-				prevp = ovp;
-				prevpg = ovpg;
-				ovp = pageOvflow(ovpg);
-			} else
-			{
-				if (prevpg != NULL)
-					free(prevpg);
-				putPage(r->ovflow, ovp, ovpg);
-				return pid;
+	b->hashes[b->tl.ntups] = h;
+	appendTuple(&b->tl, t, len);
+}
+
+static size_t bulkMemory(BulkList *b)
+{
+	return b->tl.used + b->tl.ntups*(sizeof(size_t)+sizeof(Bits));
+}
+
+static void freeBulkList(BulkList *b)
+{
+	freeTupleList(&b->tl);
+	free(b->hashes);
+}
+
+// spilled tuples are stored as (hash, length, chars)
+
+static void spillTuple(FILE *f, Tuple t, Count len, Bits h)
+{
+	unsigned short n = len;
+	fwrite(&h, sizeof(Bits), 1, f);
+	fwrite(&n, sizeof(n), 1, f);
+	fwrite(t, 1, len, f);
+}
+
+static void loadSpill(FILE *f, BulkList *b)
+{
+	char t[MAXTUPLEN];
+	Bits h; unsigned short n;
+	rewind(f);
+	while (fread(&h, sizeof(Bits), 1, f) == 1) {
+		if (fread(&n, sizeof(n), 1, f) != 1 || fread(t, 1, n, f) != n)
+			fatal("Can't read bulk load spill file");
+		t[n] = '\0';
+		appendBulk(b, t, n, h);
+	}
+}
+
+// write tuples t[0..n-1] as the chain for bucket pid
+// overflow pages are appended to the file, starting at *nextov
+
+static void writeBulkChain(Reln r, PageID pid, TupleList *l, Count *order,
+                           Count n, PageID *nextov)
+{
+	Page prim = newPage(r->pagesize);
+	Page pg = prim;
+	PageID cur = pid;
+	Count i;
+	for (i = 0; i < n; i++) {
+		Tuple t = l->buf + l->offs[order[i]];
+		if (addToPage(pg, t) == OK) continue;
+		PageID next = (*nextov)++;
+		pageSetOvflow(pg, next);
+		if (pg != prim) {
+			writePage(r->ovflow, cur, pg);
+			freePage(pg);
+		}
+		cur = next;
+		pg = newPage(r->pagesize);
+		if (addToPage(pg, t) != OK) fatal("Tuple too large for page");
+	}
+	if (pg != prim) {
+		pageSetTail(prim, cur, pageFreeSpace(pg));
+		writePage(r->ovflow, cur, pg);
+		freePage(pg);
+	}
+	writePage(r->data, pid, prim);
+	freePage(prim);
+}
+
+// write every bucket b of shape s with b % nparts == part
+// b holds exactly the tuples for those buckets
+
+static void writeBulkBuckets(Reln r, Reln s, BulkList *b, Count part,
+                             Count nparts, PageID *nextov)
+{
+	Count i, n = b->tl.ntups;
+	Count *start = calloc(s->npages+1, sizeof(Count));
+	Count *order = malloc((n+1) * sizeof(Count));
+	PageID *bucket = malloc((n+1) * sizeof(PageID));
+	assert(start != NULL && order != NULL && bucket != NULL);
+	// counting sort by bucket, stable so input order is kept
+	for (i = 0; i < n; i++) {
+		bucket[i] = bucketOf(s, b->hashes[i]);
+		start[bucket[i]+1]++;
+	}
+	for (i = 0; i < s->npages; i++) start[i+1] += start[i];
+	Count *fill = malloc((s->npages+1) * sizeof(Count));
+	assert(fill != NULL);
+	memcpy(fill, start, (s->npages+1) * sizeof(Count));
+	for (i = 0; i < n; i++) order[fill[bucket[i]]++] = i;
+	PageID p;
+	for (p = part; p < s->npages; p += nparts)
+		writeBulkChain(r, p, &b->tl, order+start[p], start[p+1]-start[p],
+		               nextov);
+	free(fill);
+	free(bucket);
+	free(order);
+	free(start);
+}
+
+// tuples gathered for bulkWrite(), in memory while they fit in budget
+//   bytes, then spilled to temp files, one per partition
+
+typedef struct {
+	BulkList b;
+	FILE    *parts[1 << MAXPARTBITS];
+	Count    nparts;  // 0 while nothing has been spilled
+	size_t   budget;
+} BulkLoad;
+
+static void initBulkLoad(BulkLoad *l, size_t budget)
+{
+	initBulkList(&l->b);
+	l->nparts = 0;
+	l->budget = budget;
+}
+
+// add tuple t, with hash h, to be written into a relation of shape s
+
+static void bulkAdd(BulkLoad *l, Reln s, Tuple t, Count len, Bits h)
+{
+	Count i;
+	if (l->nparts == 0 && bulkMemory(&l->b) > l->budget) {
+		// over budget; everything from now on goes to temp files
+		// depth only grows, so the low depth bits of the
+		//   hash will always determine the partition
+		Count bits = (s->depth < MAXPARTBITS) ? s->depth : MAXPARTBITS;
+		l->nparts = 1 << bits;
+		for (i = 0; i < l->nparts; i++) {
+			l->parts[i] = tmpfile();
+			if (l->parts[i] == NULL) fatal("Can't create spill file");
+		}
+		BulkList *b = &l->b;
+		for (i = 0; i < b->tl.ntups; i++)
+			spillTuple(l->parts[b->hashes[i] & (l->nparts-1)],
+			           b->tl.buf + b->tl.offs[i],
+			           strlen(b->tl.buf + b->tl.offs[i]), b->hashes[i]);
+		freeBulkList(b);
+		initBulkList(b);
+	}
+	if (l->nparts > 0)
+		spillTuple(l->parts[h & (l->nparts-1)], t, len, h);
+	else
+		appendBulk(&l->b, t, len, h);
+}
+
+// write all buckets of shape s, straight to r's files, and give r
+//   the shape's header
+
+static void bulkWrite(BulkLoad *l, Reln r, Reln s)
+{
+	Count i;
+	dropPages(r->data);
+	dropPages(r->ovflow);
+	off_t ovsize = lseek(r->ovflow, 0, SEEK_END);
+	PageID firstov = ovsize / r->pagesize, nextov = firstov;
+	if (l->nparts == 0)
+		writeBulkBuckets(r, s, &l->b, 0, 1, &nextov);
+	else {
+		for (i = 0; i < l->nparts; i++) {
+			freeBulkList(&l->b);
+			initBulkList(&l->b);
+			loadSpill(l->parts[i], &l->b);
+			fclose(l->parts[i]);
+			writeBulkBuckets(r, s, &l->b, i, l->nparts, &nextov);
+		}
+	}
+	freeBulkList(&l->b);
+
+	r->depth = s->depth;
+	r->sp = s->sp;
+	r->npages = s->npages;
+	r->ntups = s->ntups;
+	r->nbytes = s->nbytes;
+	r->novused += nextov - firstov;
+}
+
+// load all tuples from in into an empty relation
+// keeps at most budget bytes of tuples in memory
+// returns #tuples loaded, or -1 if the relation isn't suitable:
+//   it must be empty and not logged, and the split policy must not
+//   depend on how overflow pages are used, since that is decided as
+//   tuples arrive
+
+int bulkLoadRelation(Reln r, FILE *in, size_t budget)
+{
+	if (r->ntups != 0 || r->split == SPLIT_OVFLOW || r->wal != NULL)
+		return -1;
+
+	// the relation as it would be after incremental inserts
+	struct RelnRep shape = *r;
+	Reln s = &shape;
+
+	BulkLoad l;
+	initBulkLoad(&l, budget);
+	Tuple t;
+	while ((t = readTuple(r, in)) != NULL) {
+		if (needSplit(s)) advanceSplitPointer(s);
+		s->ntups++;
+		s->nbytes += pageTupleSpace(t);
+		bulkAdd(&l, s, t, tupLength(t), tupleHash(r, t));
+		free(t);
+	}
+	bulkWrite(&l, r, s);
+	return r->ntups;
+}
+
+// rebuild relation name with the choice vector cv
+// the tuples are read a bucket at a time, hashed with cv, and
+//   written by the bulk load code, keeping at most budget bytes of
+//   them in memory; the result has the old relation's shape (depth,
+//   sp, #pages), so works with any split policy, and is compact
+// queries may run meanwhile; processes that would change the
+//   relation wait until it's done (see lockInfo() above)
+// returns #tuples, or -1 if cv is invalid or the relation is being
+//   logged by a running process
+
+int reclusterRelation(char *name, char *cv, size_t budget)
+{
+	char fname[MAXFILENAME], shadow[MAXFILENAME];
+	// finish any swap or recovery left over, before taking locks
+	closeRelation(openRelation(name, "r"));
+	// keep writers out, from before the header is read until after
+	//   the swap; retry if another recluster swapped .info meanwhile
+	sprintf(fname, "%s.info", name);
+	int lock;
+	for (;;) {
+		lock = open(fname, O_RDWR);
+		if (lock < 0) fatal("Can't lock relation info");
+		lockInfo(lock, INFO_WRITERS, F_WRLCK);
+		if (sameFile(lock, fname)) break;
+		close(lock);
+	}
+	Reln r = openFiles(name, "r");
+	sprintf(fname, "%s.wal", name);
+	if (access(fname, F_OK) == 0) {
+		// left by a logging process that died as we waited
+		close(lock);
+		closeRelation(r);
+		return -1;
+	}
+	sprintf(shadow, "%s~", name);
+	if (newRelation(shadow, r->nattrs, 1, 0, cv, r->pagesize,
+	                r->split, r->splitarg) != OK) {
+		close(lock);
+		closeRelation(r);
+		return -1;
+	}
+	Reln s = openFiles(shadow, "r+");
+	s->depth = r->depth;
+	s->sp = r->sp;
+	s->npages = r->npages;
+
+	// stream the old buckets in order; overflow pages are read
+	//   ahead, since chains visit them out of order
+	posix_fadvise(r->data, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(r->ovflow, 0, 0, POSIX_FADV_WILLNEED);
+	BulkLoad l;
+	initBulkLoad(&l, budget);
+	PageID p;
+	for (p = 0; p < r->npages; p++) {
+		int fd = r->data;
+		PageID pid = p;
+		while (pid != NO_PAGE) {
+			Page pg = getPage(fd, pid);
+			Count i, n = pageNTuples(pg);
+			for (i = 0; i < n; i++) {
+				if (!pageTupleLive(pg, i)) continue;
+				Tuple t = pageTuple(pg, i);
+				s->ntups++;
+				s->nbytes += pageTupleSpace(t);
+				bulkAdd(&l, s, t, pageTupleLen(pg, i), tupleHash(s, t));
 			}
+			pid = pageOvflow(pg);
+			releasePage(pg);
+			fd = r->ovflow;
 		}
-		// all overflow pages are full; add another to chain
-		// at this point, there *must* be a prevpg
-		assert(prevpg != NULL);
-		// make new ovflow page
-		PageID newp = addPage(r->ovflow);
-		// insert tuple into new page
-		Page newpg = getPage(r->ovflow, newp);
-		if (addToPage(newpg, t) != OK)
-			return NO_PAGE;
-		putPage(r->ovflow, newp, newpg);
-		// link to existing overflow chain
-		pageSetOvflow(prevpg, newp);
-		putPage(r->ovflow, prevp, prevpg);
-		return pid;
 	}
+	bulkWrite(&l, s, s);
+	writeInfo(s);
+	fflush(s->info);
+	if (fsync(s->data) < 0 || fsync(s->ovflow) < 0
+	    || fsync(fileno(s->info)) < 0)
+		fatal("Can't sync reclustered relation");
+	int n = s->ntups;
+	closeRelation(s);
+
+	// commit to the swap, then do it
+	lockInfo(lock, INFO_FILES, F_WRLCK);
+	sprintf(fname, "%s.swap", name);
+	int fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0 || fsync(fd) < 0) fatal("Can't create swap marker");
+	close(fd);
+	syncDir(name);
+	finishSwap(name);
+	close(lock);
+	closeRelation(r);
+	return n;
 }
 
 // external interfaces for Reln data
 
-FILE *dataFile(Reln r) { return r->data; }
-FILE *ovflowFile(Reln r) { return r->ovflow; }
+int dataFile(Reln r) { return r->data; }
+int ovflowFile(Reln r) { return r->ovflow; }
 Count nattrs(Reln r) { return r->nattrs; }
 Count npages(Reln r) { return r->npages; }
+Count novused(Reln r) { return r->novused; }
 Count ntuples(Reln r) { return r->ntups; }
 Count depth(Reln r)  { return r->depth; }
 Count splitp(Reln r) { return r->sp; }
+Count pagesize(Reln r) { return r->pagesize; }
 ChVecItem *chvec(Reln r)  { return r->cv; }
+ChVecMap *chvecMap(Reln r)  { return r->cvmap; }
 
 
 // displays info about open Reln
 
+// e.g. "load 75%", for display
+
+char *splitPolicyString(Count split, Count arg)
+{
+	static char buf[32];
+	switch (split) {
+	case SPLIT_LOAD:   sprintf(buf, "load %d%%", arg); break;
+	case SPLIT_OVFLOW: sprintf(buf, "ovflow %d%%", arg); break;
+	default:           sprintf(buf, "count"); break;
+	}
+	return buf;
+}
+
 void relationStats(Reln r)
 {
 	printf("Global Info:\n");
-	printf("#attrs:%d  #pages:%d  #tuples:%d  d:%d  sp:%d\n",
-	       r->nattrs, r->npages, r->ntups, r->depth, r->sp);
+	printf("#attrs:%d  #pages:%d  #tuples:%d  d:%d  sp:%d  pagesize:%d\n",
+	       r->nattrs, r->npages, r->ntups, r->depth, r->sp, r->pagesize);
+	off_t ovsize = lseek(r->ovflow, 0, SEEK_END);
+	Count novflow = ovsize / r->pagesize;
+	printf("#ovflow pages:%d  used:%d  free:%d\n",
+	       novflow, r->novused, r->nfreeov);
+	printf("split policy:%s  load factor:%.2f  avg chain length:%.2f\n",
+	       splitPolicyString(r->split, r->splitarg), loadFactor(r),
+	       1.0 + (double)r->novused/r->npages);
 	printf("Choice vector\n");
 	printChVec(r->cv);
 	printf("Bucket Info:\n");
@@ -359,19 +1568,19 @@ void relationStats(Reln r)
 	for (Offset pid = 0; pid < r->npages; pid++) {
 		printf("[%2d]  ",pid);
 		Page p = getPage(r->data, pid);
-		Count ntups = pageNTuples(p);
+		Count ntups = pageNLive(p);
 		Count space = pageFreeSpace(p);
 		Offset ovid = pageOvflow(p);
 		printf("(d%d,%d,%d,%d)",pid,ntups,space,ovid);
-		free(p);
+		releasePage(p);
 		while (ovid != NO_PAGE) {
 			Offset curid = ovid;
 			p = getPage(r->ovflow, ovid);
-			ntups = pageNTuples(p);
+			ntups = pageNLive(p);
 			space = pageFreeSpace(p);
 			ovid = pageOvflow(p);
 			printf(" -> (ov%d,%d,%d,%d)",curid,ntups,space,ovid);
-			free(p);
+			releasePage(p);
 		}
 		putchar('\n');
 	}
@@ -13,19 +13,44 @@ typedef struct RelnRep *Reln;
 #include "page.h"
 #include "chvec.h"
 
-Status newRelation(char *name, Count nattr, Count npages, Count d, char *cv);
+#define NLATCHES 64  // bucket latches used by shareRelation()
+
+// split policies; see needSplit() in reln.c
+#define SPLIT_COUNT  0  // every pagesize/(10*nattrs) inserts
+#define SPLIT_LOAD   1  // load factor above arg%
+#define SPLIT_OVFLOW 2  // overflow pages above arg% of primary pages
+
+Status newRelation(char *name, Count nattr, Count npages, Count d, char *cv,
+                   Count pagesize, Count split, Count splitarg);
 Reln openRelation(char *name, char *mode);
 void closeRelation(Reln r);
 Bool existsRelation(char *name);
 PageID addToRelation(Reln r, Tuple t);
-FILE *dataFile(Reln r);
-FILE *ovflowFile(Reln r);
+int deleteFromRelation(Reln r, char *q);
+int updateRelation(Reln r, char *q, Tuple *new, Count n);
+void shareRelation(Reln r);
+PageID addToRelationShared(Reln r, Tuple t, Bits h);
+Bool logRelation(Reln r, char *name, Count window);
+void checkpointRelation(Reln r);
+Bool concurrentRelation(Reln r);
+Bool writableRelation(Reln r);
+Bool refreshRelation(Reln r);
+void lockBucket(Reln r, PageID p);
+void unlockBucket(Reln r, PageID p);
+int bulkLoadRelation(Reln r, FILE *in, size_t budget);
+int reclusterRelation(char *name, char *cv, size_t budget);
+int dataFile(Reln r);
+int ovflowFile(Reln r);
 Count nattrs(Reln r);
 Count npages(Reln r);
+Count novused(Reln r);
 Count depth(Reln r);
 Count splitp(Reln r);
+Count pagesize(Reln r);
 ChVecItem *chvec(Reln r);
+ChVecMap *chvecMap(Reln r);
 void relationStats(Reln r);
+char *splitPolicyString(Count split, Count arg);
 void splitRelation(Reln r);
 PageID reScheduleRelation(Reln r, Tuple t, PageID pid);
 
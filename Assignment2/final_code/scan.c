@@ -0,0 +1,177 @@
+// scan.c ... sequential scans of a relation
+// part of Multi-attribute Linear-hashed Files
+// A Scan visits every page of a relation that holds live tuples, by
+//   streaming the data file's bucket pages and then the overflow file,
+//   SCANBYTES at a time, rather than following each bucket's chain
+// The files are read directly, not via the buffer pool, so a Scan
+//   only suits relations that no process is changing
+
+#include <fcntl.h>
+#include <unistd.h>
+#include "defs.h"
+#include "scan.h"
+#include "reln.h"
+#include "page.h"
+#include "buffer.h"
+
+// Pages that aren't part of the relation are skipped
+// - pages the data file holds past npages are left over from contraction
+// - an overflow page is only used if some chain reaches it, so free
+//   pages, and orphans left by e.g. an interrupted bulk load, are not
+// - reading the data file marks the first page of each chain, and a
+//   marked overflow page marks the next page in its chain
+// - an overflow page not yet marked when the scan passes it is noted,
+//   and read again at the end if it has been marked since; chains
+//   mostly run forwards through the file, so these are few
+// - every such page is noted, even one with no live tuples, as the
+//   pages after it in its chain are only reached through its link
+
+struct ScanRep {
+	Reln    rel;
+	int     fd;        // file being read
+	Bool    inovflow;  // is it the overflow file?
+	PageID  next;      // next page to read from fd
+	Count   end;       // # pages to read from fd
+	Count   ovpages;   // # pages in the overflow file
+	Count   psize;     // bytes per page
+	char   *chunk;     // pages last read from fd
+	Count   nchunk;    // # pages in chunk
+	Count   inchunk;   // index in chunk of next page to look at
+	Byte   *reached;   // bitmap of overflow pages some chain reaches
+	PageID *later;     // overflow pages noted for the end
+	Count   nlater, maxlater;
+	Page    page;      // buffer for reading them
+	Count   ndata;     // # pages read from the data file
+	Count   novflow;   // # pages read from the overflow file
+};
+
+static void reach(Scan s, PageID pid)
+{
+	if (pid != NO_PAGE && pid < s->ovpages)
+		s->reached[pid/8] |= (1 << (pid%8));
+}
+
+static Bool isReached(Scan s, PageID pid)
+{
+	return (s->reached[pid/8] & (1 << (pid%8))) != 0;
+}
+
+Scan startScan(Reln r)
+{
+	Scan s = malloc(sizeof(struct ScanRep));
+	assert(s != NULL);
+	s->rel = r;
+	s->psize = pagesize(r);
+	s->fd = dataFile(r);
+	s->inovflow = FALSE;
+	s->next = 0;
+	s->end = npages(r);
+	s->ovpages = lseek(ovflowFile(r), 0, SEEK_END) / s->psize;
+	s->chunk = malloc(SCANBYTES);
+	s->reached = calloc(s->ovpages/8 + 1, 1);
+	assert(s->chunk != NULL && s->reached != NULL);
+	s->nchunk = s->inchunk = 0;
+	s->later = NULL;
+	s->nlater = s->maxlater = 0;
+	s->page = NULL;
+	s->ndata = s->novflow = 0;
+	posix_fadvise(dataFile(r), 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(ovflowFile(r), 0, 0, POSIX_FADV_SEQUENTIAL);
+	return s;
+}
+
+// read the next chunk of pages; FALSE once both files are done
+
+static Bool readChunk(Scan s)
+{
+	Count max = SCANBYTES / s->psize;
+	while (s->next >= s->end) {
+		if (s->inovflow) return FALSE;
+		s->inovflow = TRUE;
+		s->fd = ovflowFile(s->rel);
+		s->next = 0;
+		s->end = s->ovpages;
+	}
+	Count n = (s->end - s->next < max) ? s->end - s->next : max;
+	n = readPages(s->fd, s->next, n, s->chunk);
+	if (n == 0) fatal("Can't read relation for scan");
+	if (s->inovflow) s->novflow += n; else s->ndata += n;
+	s->next += n;
+	s->nchunk = n;
+	s->inchunk = 0;
+	// have the next chunk read while this one is used
+	posix_fadvise(s->fd, (off_t)s->next * s->psize, SCANBYTES,
+	              POSIX_FADV_WILLNEED);
+	return TRUE;
+}
+
+static void noteLater(Scan s, PageID pid)
+{
+	if (s->nlater == s->maxlater) {
+		s->maxlater = (s->maxlater == 0) ? 64 : 2*s->maxlater;
+		s->later = realloc(s->later, s->maxlater*sizeof(PageID));
+		assert(s->later != NULL);
+	}
+	s->later[s->nlater++] = pid;
+}
+
+// read a noted page with live tuples that some chain has reached
+//   since; NULL if none
+// the ones left are orphans
+
+static Page laterPage(Scan s)
+{
+	Count i = 0;
+	while (i < s->nlater) {
+		PageID pid = s->later[i];
+		if (!isReached(s, pid)) { i++; continue; }
+		s->later[i] = s->later[--s->nlater];
+		if (s->page == NULL) s->page = allocPage(s->psize);
+		readPage(ovflowFile(s->rel), pid, s->page);
+		s->novflow++;
+		reach(s, pageOvflow(s->page));
+		if (pageNLive(s->page) > 0) return s->page;
+		// an empty page may have reached one already passed over
+		i = 0;
+	}
+	return NULL;
+}
+
+// the next page with live tuples, or NULL at the end of the scan
+// a page stays valid until a chunk is read; if stay, NULL is
+//   returned rather than do that, and the scan can carry on later
+
+Page nextScanPage(Scan s, Bool stay)
+{
+	for (;;) {
+		if (s->inchunk == s->nchunk) {
+			if (stay) return NULL;
+			if (!readChunk(s)) return laterPage(s);
+		}
+		PageID pid = s->next - s->nchunk + s->inchunk;
+		Page pg = (Page)(s->chunk + (size_t)s->inchunk++ * s->psize);
+		if (s->inovflow && !isReached(s, pid)) {
+			noteLater(s, pid);
+			continue;
+		}
+		reach(s, pageOvflow(pg));
+		if (pageNLive(pg) > 0) return pg;
+	}
+}
+
+// # pages read from each file so far
+
+void scanStats(Scan s, Count *ndata, Count *novflow)
+{
+	*ndata = s->ndata;
+	*novflow = s->novflow;
+}
+
+void closeScan(Scan s)
+{
+	if (s->page != NULL) freePage(s->page);
+	free(s->later);
+	free(s->reached);
+	free(s->chunk);
+	free(s);
+}
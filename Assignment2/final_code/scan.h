@@ -0,0 +1,21 @@
+// scan.h ... interface to sequential scans of a relation
+// part of Multi-attribute Linear-hashed Files
+// See scan.c for details of the Scan type and functions
+
+#ifndef SCAN_H
+#define SCAN_H 1
+
+typedef struct ScanRep *Scan;
+
+#include "defs.h"
+#include "reln.h"
+#include "page.h"
+
+#define SCANBYTES (4 << 20)  // bytes read from a file at a time
+
+Scan startScan(Reln);
+Page nextScanPage(Scan, Bool stay);
+void scanStats(Scan, Count *ndata, Count *novflow);
+void closeScan(Scan);
+
+#endif
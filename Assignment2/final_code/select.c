@@ -1,16 +1,213 @@
 // select.c ... run queries
 // part of Multi-attribute linear-hashed files
 // Ask a query on a named relation
-// Usage:  ./select  [-v]  RelName  v1,v2,v3,v4,...
+// Usage:  ./select  [-v|-e]  [-m|-a|-c]  [-j N [-o]]  RelName  v1,v2,v3,v4,...
 // where any of the vi's can be "?" (unknown)
+// -e shows how the query would be answered, without running it
+// -v runs the query, then shows how it was answered and what
+//   that took: pages read, tuples examined and matched, and time;
+//   with -a, also whether io_uring or threads did the prefetching
+// -m reads the relation's pages via mmap
+// -a reads candidate buckets asynchronously, ahead of the scan
+// -c runs alongside an "insert -c" on the same relation
+// -j probes the candidate buckets with N threads; -o keeps the
+//   results in the order a single thread would give
 
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "defs.h"
 #include "query.h"
 #include "tuple.h"
 #include "reln.h"
 #include "chvec.h"
+#include "buffer.h"
 
-#define USAGE "./select  [-v]  RelName  v1,v2,v3,v4,..."
+#define USAGE "./select  [-v|-e]  [-m|-a|-c]  [-j N [-o]]  RelName  v1,v2,v3,v4,..."
+
+#define BATCH   1024       // matches fetched per call
+#define OUTBUF  (1 << 20)  // bytes of output buffered before writing
+#define MAXJOBS 64         // max threads for -j
+
+// results are collected in a large buffer and written in big chunks
+
+static char outbuf[OUTBUF];
+static size_t outlen = 0;
+
+static void flushOutput()
+{
+	size_t done = 0;
+	while (done < outlen) {
+		ssize_t n = write(STDOUT_FILENO, outbuf+done, outlen-done);
+		if (n < 0) fatal("Can't write results");
+		done += n;
+	}
+	outlen = 0;
+}
+
+static void output(char *t, Count len)
+{
+	if (outlen + len + 1 > OUTBUF) flushOutput();
+	memcpy(outbuf+outlen, t, len);
+	outlen += len;
+	outbuf[outlen++] = '\n';
+}
+
+// write a block of complete result lines
+
+static void outputBlock(char *buf, size_t len)
+{
+	if (outlen + len > OUTBUF) flushOutput();
+	if (len > OUTBUF) {
+		size_t done = 0;
+		while (done < len) {
+			ssize_t n = write(STDOUT_FILENO, buf+done, len-done);
+			if (n < 0) fatal("Can't write results");
+			done += n;
+		}
+		return;
+	}
+	memcpy(outbuf+outlen, buf, len);
+	outlen += len;
+}
+
+// Parallel query (-j)
+// the candidate buckets are shared out as equal runs, one per worker
+// a worker takes buckets from the front of its own run; when that is
+//   empty, it steals the back half of the longest run left, so a few
+//   long overflow chains don't hold up the end of the query
+// each bucket's matches are collected in a buffer, then output: as
+//   soon as the bucket is done, or with -o, in bucket order
+
+typedef struct {
+	Count lo, hi;  // buckets [lo,hi) not yet taken
+	pthread_mutex_t lock;
+} Run;
+
+typedef struct {
+	char  *buf;
+	size_t len, max;
+} Result;
+
+static Reln     rel;
+static Query    query;
+static Run      runs[MAXJOBS];
+static int      njobs;
+static Bool     ordered;
+static Result  *results;   // with -o, results of buckets done early
+static Bool    *ready;     // ... and which those are
+static Count    nextout;   // with -o, next bucket to output
+static pthread_mutex_t outlock = PTHREAD_MUTEX_INITIALIZER;
+
+// give worker w its next bucket; FALSE if none are left
+
+static Bool takeBucket(int w, Count *bi)
+{
+	Run *own = &runs[w];
+	for (;;) {
+		pthread_mutex_lock(&own->lock);
+		if (own->lo < own->hi) {
+			*bi = own->lo++;
+			pthread_mutex_unlock(&own->lock);
+			return TRUE;
+		}
+		pthread_mutex_unlock(&own->lock);
+		// steal; the run lengths may change once we've looked
+		int i, v = -1;
+		Count most = 0;
+		for (i = 0; i < njobs; i++) {
+			pthread_mutex_lock(&runs[i].lock);
+			Count left = runs[i].hi - runs[i].lo;
+			pthread_mutex_unlock(&runs[i].lock);
+			if (left > most) { most = left; v = i; }
+		}
+		if (v < 0) return FALSE;
+		Count lo, hi;
+		pthread_mutex_lock(&runs[v].lock);
+		lo = runs[v].lo + (runs[v].hi - runs[v].lo)/2;
+		hi = runs[v].hi;
+		if (runs[v].lo < hi) runs[v].hi = lo;
+		pthread_mutex_unlock(&runs[v].lock);
+		if (lo >= hi) continue;
+		pthread_mutex_lock(&own->lock);
+		own->lo = lo;  own->hi = hi;
+		pthread_mutex_unlock(&own->lock);
+	}
+}
+
+static void collect(void *arg, Match *m)
+{
+	Result *res = arg;
+	if (res->len + m->len + 1 > res->max) {
+		res->max = (res->max == 0) ? 4096 : 2*res->max;
+		if (res->max < res->len + m->len + 1)
+			res->max = res->len + m->len + 1;
+		res->buf = realloc(res->buf, res->max);
+		assert(res->buf != NULL);
+	}
+	memcpy(res->buf+res->len, m->tup, m->len);
+	res->len += m->len;
+	res->buf[res->len++] = '\n';
+}
+
+static void finishBucket(Count bi, Result *res)
+{
+	pthread_mutex_lock(&outlock);
+	if (!ordered) {
+		outputBlock(res->buf, res->len);
+		free(res->buf);
+	}
+	else {
+		results[bi] = *res;
+		ready[bi] = TRUE;
+		while (nextout < queryNBuckets(query) && ready[nextout]) {
+			outputBlock(results[nextout].buf, results[nextout].len);
+			free(results[nextout].buf);
+			nextout++;
+		}
+	}
+	pthread_mutex_unlock(&outlock);
+}
+
+static void *worker(void *arg)
+{
+	int w = (Run *)arg - runs;
+	Page buf = allocPage(pagesize(rel));
+	Count bi;
+	while (takeBucket(w, &bi)) {
+		Result res = { NULL, 0, 0 };
+		scanBucket(query, bi, buf, collect, &res);
+		finishBucket(bi, &res);
+	}
+	freePage(buf);
+	return NULL;
+}
+
+static void parallelQuery(Reln r, Query q, int n, Bool inorder)
+{
+	pthread_t workers[MAXJOBS];
+	Count nb = queryNBuckets(q);
+	int i;
+	rel = r;  query = q;  njobs = n;  ordered = inorder;
+	if (ordered) {
+		results = malloc(nb * sizeof(Result));
+		ready = calloc(nb, sizeof(Bool));
+		assert(results != NULL && ready != NULL);
+		nextout = 0;
+	}
+	for (i = 0; i < n; i++) {
+		runs[i].lo = (Count)((unsigned long)nb * i / n);
+		runs[i].hi = (Count)((unsigned long)nb * (i+1) / n);
+		pthread_mutex_init(&runs[i].lock, NULL);
+	}
+	for (i = 0; i < n; i++)
+		pthread_create(&workers[i], NULL, worker, &runs[i]);
+	for (i = 0; i < n; i++)
+		pthread_join(workers[i], NULL);
+	for (i = 0; i < n; i++)
+		pthread_mutex_destroy(&runs[i].lock);
+	if (ordered) { free(results); free(ready); }
+}
 
 // Main ... process args, run query
 
@@ -18,23 +215,46 @@ int main(int argc, char **argv)
 {
 	Reln r;  // handle on the open relation
 	Query q;  // processed version of query string
-	Tuple t;  // tuple pointer
 	char err[MAXERRMSG];  // buffer for error messages
 	int verbose;  // show extra info on query progress
 	char *rname;  // name of table/file
 	char *qstr;   // query string
+	char *mode;   // how to open relation ("rm" = mmap, "rc" = concurrent)
+	int async;    // prefetch pages of candidate buckets
+	int explain;  // show the plan only
+	int jobs;     // # threads for parallel query
+	int inorder;  // keep parallel results in order
 
 	// process command-line args
 
-	if (argc < 3) fatal(USAGE);
-	if (strcmp(argv[1], "-v") == 0) {
-		verbose = 1;  rname = argv[2];  qstr = argv[3];
-	}
-	else {
-		verbose = 0;  rname = argv[1];  qstr = argv[2];
+	int a = 1;
+	verbose = 0;  mode = "r";  async = 0;  explain = 0;
+	jobs = 0;  inorder = 0;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-e") == 0)
+			explain = 1;
+		else if (strcmp(argv[a], "-m") == 0)
+			mode = "rm";
+		else if (strcmp(argv[a], "-a") == 0)
+			async = 1;
+		else if (strcmp(argv[a], "-c") == 0)
+			mode = "rc";
+		else if (strcmp(argv[a], "-j") == 0 && a+1 < argc) {
+			jobs = atoi(argv[++a]);
+			if (jobs < 1 || jobs > MAXJOBS) fatal(USAGE);
+		}
+		else if (strcmp(argv[a], "-o") == 0)
+			inorder = 1;
+		else
+			fatal(USAGE);
+		a++;
 	}
-
-	if (verbose) { /* keeps compiler quiet */ }
+	if (argc - a < 2 || verbose + explain > 1) fatal(USAGE);
+	if (jobs > 0 && (async || mode[1] == 'c')) fatal(USAGE);
+	if (inorder && jobs == 0) fatal(USAGE);
+	rname = argv[a];  qstr = argv[a+1];
 
 	// initialise relation and scanning structure
 
@@ -42,7 +262,7 @@ int main(int argc, char **argv)
 		sprintf(err, "No such relation: %s",rname);
 		fatal(err);
 	}
-	if ((r = openRelation(rname,"r")) == NULL) {
+	if ((r = openRelation(rname,mode)) == NULL) {
 		sprintf(err, "Can't open relation: %s",rname);
 		fatal(err);
 	}
@@ -50,13 +270,39 @@ int main(int argc, char **argv)
 		sprintf(err, "Invalid query: %s",qstr);
 		fatal(err);
 	}
+	if (jobs > 0) probeQuery(q);
+	if (explain) {
+		explainQuery(q);
+		closeQuery(q);
+		closeRelation(r);
+		return 0;
+	}
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (async) prefetchQuery(q);
 
 	// execute the query (find matching tuples)
 
-	char tup[MAXTUPLEN];
-	while ((t = getNextTuple(q)) != NULL) {
-		tupleString(t,tup);
-		printf("%s\n",tup);
+	if (jobs > 0)
+		parallelQuery(r, q, jobs, inorder);
+	else {
+		Match m[BATCH];
+		Count i, n;
+		while ((n = nextMatches(q, m, BATCH)) > 0) {
+			for (i = 0; i < n; i++) output(m[i].tup, m[i].len);
+		}
+	}
+	flushOutput();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	// the plan is shown afterwards, so its page reads don't
+	//   affect the query's
+
+	if (verbose) {
+		explainQuery(q);
+		queryStats(q);
+		printf("elapsed: %.3f ms\n", 1e3*(t1.tv_sec - t0.tv_sec)
+		       + 1e-6*(t1.tv_nsec - t0.tv_nsec));
 	}
 
 	// clean up
@@ -1,12 +1,13 @@
 // stats.c ... show statistics for a Relation
 // part of Multi-attribute linear-hashed files
 // Show info and page stats for a Relation
-// Usage:  ./stats  RelName
+// Usage:  ./stats  [-m]  RelName
 
 #include "defs.h"
 #include "reln.h"
+#include "buffer.h"
 
-#define USAGE "./stats  RelName"
+#define USAGE "./stats  [-m]  RelName"
 
 
 // Main ... process args, run query
@@ -16,16 +17,21 @@ int main(int argc, char **argv)
 	// process command-line args
 
 	if (argc < 2) fatal(USAGE);
-	char *relname = argv[1];
+	char *relname = argv[1], *mode = "r";
+	if (strcmp(argv[1], "-m") == 0) {
+		if (argc < 3) fatal(USAGE);
+		relname = argv[2];  mode = "rm";
+	}
 
 	// open relation and show stats
 
 	if (!existsRelation(relname))
 		fatal("No such relation\n");
-	Reln r = openRelation(relname,"r");
+	Reln r = openRelation(relname,mode);
 	if (r == NULL) fatal("No such relation");
 
 	relationStats(r);
+	bufferStats();
 	closeRelation(r);
 
 	return 0;
@@ -0,0 +1,76 @@
+#!/bin/sh
+# stress.sh ... check that parallel operations lose nothing
+# part of Multi-attribute linear-hashed files
+# Usage:  ./stress.sh  [#tuples  [#attrs]]
+# Loads a generated file with insert -j 4 and -j 3, and with -j 4
+#   alongside -c (while select -c runs) and -w, and checks that the
+#   whole relation, as given by select, is exactly the input
+# Then checks that select -j N gives the same tuples as select, and
+#   that select -j N -o gives them in the same order as select -j 1
+# Run after make (or via make check); uses relation stress_R
+
+N=${1:-50000}
+A=${2:-4}
+REL=stress_R
+IN=/tmp/stress_in.$$
+OUT=/tmp/stress_out.$$
+trap 'rm -f $REL.* $IN $OUT $OUT.*' 0
+
+fail=0
+
+# the query with every attribute unknown
+all=$(printf '?'; i=1; while [ $i -lt $A ]; do printf ',?'; i=$((i+1)); done)
+
+./gendata $N $A 1 | sort > $IN || exit 1
+
+for opts in "-j 4 -c" "-j 4 -w 16" "-j 4" "-j 3"
+do
+	rm -f $REL.*
+	./create $REL $A 1 "" > /dev/null || exit 1
+	./insert $opts $REL < $IN &
+	ins=$!
+	# readers see only tuples that have been inserted
+	case "$opts" in
+	*-c*)
+		sleep 0.1
+		./select -c $REL "$all" | sort > $OUT
+		if [ -n "$(comm -23 $OUT $IN)" ]
+		then
+			echo "select -c during insert $opts: FAILED"
+			fail=1
+		fi
+	esac
+	wait $ins || exit 1
+	./select $REL "$all" | sort > $OUT
+	if cmp -s $IN $OUT
+	then
+		echo "insert $opts: ok"
+	else
+		echo "insert $opts: FAILED ($(wc -l < $OUT) of $N tuples found)"
+		fail=1
+	fi
+done
+
+# queries on the last relation loaded: all unknown, and one known
+one=$(sed -n 7p $IN | cut -d, -f2)
+some=$(printf '?,%s' "$one"; i=2; while [ $i -lt $A ]; do printf ',?'; i=$((i+1)); done)
+
+for q in "$all" "$some"
+do
+	./select $REL "$q" | sort > $OUT
+	./select -j 1 $REL "$q" > $OUT.1
+	for j in 2 3 8
+	do
+		./select -j $j $REL "$q" | sort > $OUT.j
+		./select -j $j -o $REL "$q" > $OUT.o
+		if cmp -s $OUT $OUT.j && cmp -s $OUT.1 $OUT.o
+		then
+			echo "select -j $j $q: ok"
+		else
+			echo "select -j $j $q: FAILED"
+			fail=1
+		fi
+	done
+done
+
+exit $fail
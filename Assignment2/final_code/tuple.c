@@ -8,6 +8,7 @@
 #include "hash.h"
 #include "chvec.h"
 #include "bits.h"
+#include "page.h"
 
 // return number of bytes/chars in a tuple
 
@@ -35,6 +36,7 @@ Tuple readTuple(Reln r, FILE *in)
 }
 
 // extract values into an array of strings
+// t is not modified, since it may be in a read-only mapped page
 
 void tupleVals(Tuple t, char **vals)
 {
@@ -42,18 +44,14 @@ void tupleVals(Tuple t, char **vals)
 	int i = 0;
 	for (;;) {
 		while (*c != ',' && *c != '\0') c++;
-		if (*c == '\0') {
-			// end of tuple; add last field to vals
-			vals[i++] = copyString(c0);
-			break;
-		}
-		else {
-			// end of next field; add to vals
-			*c = '\0';
-			vals[i++] = copyString(c0);
-			*c = ',';
-			c++; c0 = c;
-		}
+		// copy field c0..c-1 into vals
+		vals[i] = malloc(c-c0+1);
+		assert(vals[i] != NULL);
+		memcpy(vals[i], c0, c-c0);
+		vals[i][c-c0] = '\0';
+		i++;
+		if (*c == '\0') break;
+		c++; c0 = c;
 	}
 }
 
@@ -66,45 +64,24 @@ void freeVals(char **vals, int nattrs)
 }
 
 // hash a tuple using the choice vector
-// TODO: actually use the choice vector to make the hash
+// hashes each field in place, in one pass over the tuple,
+//   and maps its hash onto tuple-hash bits via the compiled cv
 
 Bits tupleHash(Reln r, Tuple t)
 {
-	int i;
-	Count nvals = nattrs(r);
-	char **vals = malloc(nvals*sizeof(char *));
-	assert(vals != NULL);
-	tupleVals(t, vals);
-
-	// Bits hash = hash_any((unsigned char *)vals[0],strlen(vals[0]));
-  Bits hash = 0;
-	Bits val_hash[nvals];
-	for(i=0;i<nvals;i++){
-			val_hash[i] = hash_any((unsigned char *)vals[i], strlen(vals[i]));
-	}
-
-	ChVecItem *c;
-	c = chvec(r);
-	for (i=0;i<MAXCHVEC;i++){
-	  Byte att = c[i].att;
-	  Byte bit = c[i].bit;
-	  if (bitIsSet(val_hash[att],bit)){
-	    hash = setBit(hash,i);
-	  }else{
-			hash = unsetBit(hash,i);
-		}
+	ChVecMap *map = chvecMap(r);
+	Count a = 0, na = nattrs(r);
+	Bits hash = 0;
+	char *c = t, *c0 = t;
+	for (;;) {
+		while (*c != ',' && *c != '\0') c++;
+		// attributes not in the choice vector needn't be hashed
+		if (a < na && map[a].mask != 0)
+			hash |= chvecApply(&map[a], hash_any((unsigned char *)c0, c-c0));
+		a++;
+		if (*c == '\0') break;
+		c++; c0 = c;
 	}
-	//bitsString(hash,buf);
-	//Show info
-	// printf("hash(");
-	// for(i=0;i<nvals;i++){
-	// 	if(i == nvals - 1){
-	// 		printf("%s)  = %s\n", vals[i], buf);
-	// 	}else{
-	// 		printf("%s,", vals[i]);
-	// 	}
-	// }
-	//printf("%s\n", t);
 	return hash;
 }
 
@@ -129,6 +106,89 @@ Bool tupleMatch(Reln r, Tuple t1, Tuple t2)
 	return match;
 }
 
+// compiled form of a query string such as "1234,?,abc,?"
+// holds just the known attributes, in attribute order,
+//   so candidates can be checked without splitting them up
+
+typedef struct {
+	Count  attr;  // which attribute (0..nattrs-1)
+	char  *val;   // its value (points into qstr)
+	Count  len;   // length of that value
+} Known;
+
+struct PredRep {
+	Count  nknown;   // # attributes with known values
+	char  *qstr;     // private copy of query string
+	Known  known[];  // one per known attribute, up to nattrs
+};
+
+// compile a query string; NULL if it has the wrong # of attributes
+
+Pred compilePred(Reln r, char *q)
+{
+	Count na = nattrs(r);
+	Pred p = malloc(sizeof(struct PredRep) + na*sizeof(Known));
+	assert(p != NULL);
+	p->qstr = copyString(q);
+	p->nknown = 0;
+	Count a = 0;
+	char *c = p->qstr, *c0 = c;
+	for (;;) {
+		while (*c != ',' && *c != '\0') c++;
+		if (a == na) {
+			// too many attributes
+			freePred(p);
+			return NULL;
+		}
+		// assumes no real attribute values start with '?'
+		if (*c0 != '?') {
+			Known *k = &p->known[p->nknown++];
+			k->attr = a;
+			k->val = c0;
+			k->len = c - c0;
+		}
+		a++;
+		if (*c == '\0') break;
+		c++; c0 = c;
+	}
+	if (a != na) {
+		freePred(p);
+		return NULL;
+	}
+	return p;
+}
+
+// does tuple t satisfy the predicate?
+// walks the fields of t in place; gives up at first mismatch
+
+Bool predMatch(Pred p, Tuple t)
+{
+	Count i, a = 0;
+	char *c = t;
+	for (i = 0; i < p->nknown; i++) {
+		Known *k = &p->known[i];
+		// skip to start of the next known attribute
+		while (a < k->attr) {
+			while (*c != ',') {
+				if (*c == '\0') return FALSE;
+				c++;
+			}
+			c++; a++;
+		}
+		Count n = k->len;
+		if (strncmp(c, k->val, n) != 0) return FALSE;
+		if (c[n] != ',' && c[n] != '\0') return FALSE;
+		c += n;
+	}
+	return TRUE;
+}
+
+void freePred(Pred p)
+{
+	free(p->qstr);
+	free(p);
+}
+
 // puts printable version of tuple in user-supplied buffer
 
 void tupleString(Tuple t, char *buf)
@@ -136,11 +196,13 @@ void tupleString(Tuple t, char *buf)
 	strcpy(buf,t);
 }
 
-Tuple nextTuple(FILE *in,PageID pid,Offset curtup)
+// copy tuple number curtup in page pid
+// goes via the buffer pool, since the file may be out of date
+
+Tuple nextTuple(int fd,PageID pid,Count curtup)
 {
-	char line[MAXTUPLEN];
-	Offset base = PAGESIZE * pid + 2 * sizeof(Offset) + sizeof(Count);
-	fseek(in, base + curtup, SEEK_SET);
-	fgets(line, MAXTUPLEN - 1, in);
-	return copyString(line); 
+	Page pg = getPage(fd, pid);
+	Tuple t = copyString(pageTuple(pg, curtup));
+	releasePage(pg);
+	return t;
 }
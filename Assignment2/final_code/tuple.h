@@ -9,6 +9,7 @@
 #define TUPLE_H 1
 
 typedef char *Tuple;
+typedef struct PredRep *Pred;
 
 #include "reln.h"
 #include "bits.h"
@@ -19,7 +20,10 @@ Bits tupleHash(Reln r, Tuple t);
 void tupleVals(Tuple t, char **vals);
 void freeVals(char **vals, int nattrs);
 Bool tupleMatch(Reln r, Tuple t1, Tuple t2);
+Pred compilePred(Reln r, char *q);
+Bool predMatch(Pred p, Tuple t);
+void freePred(Pred p);
 void tupleString(Tuple t, char *buf);
-Tuple nextTuple(FILE *in,PageID pid,Offset curtup);
+Tuple nextTuple(int fd,PageID pid,Count curtup);
 
 #endif
@@ -0,0 +1,135 @@
+// update.c ... change tuples in a relation
+// part of Multi-attribute linear-hashed files
+// Sets attribute values in every tuple that matches a query
+// Usage:  ./update  [-v]  [-w N]  RelName  v1,v2,v3,...  u1,u2,u3,...
+// where any of the vi's can be "?" (unknown), and each ui that
+//   is not "?" becomes the value of that attribute
+// Matching tuples are deleted, then re-inserted with the new values,
+//   since they will usually hash to a different bucket
+// -w logs the changes, syncing the log after every N of them; the
+//   update is logged as one change, so a crash can't lose part of it
+
+#include "defs.h"
+#include "reln.h"
+#include "query.h"
+#include "tuple.h"
+
+#define USAGE "./update  [-v]  [-w N]  RelName  v1,v2,v3,...  u1,u2,u3,..."
+
+// t with the values in u that aren't "?"
+
+static Tuple newValues(Tuple t, char *u)
+{
+	char buf[MAXTUPLEN];
+	char *b = buf, *c = t;
+	for (;;) {
+		char *c0 = c, *u0 = u;
+		while (*c != ',' && *c != '\0') c++;
+		while (*u != ',' && *u != '\0') u++;
+		// value to use, from..to
+		char *from = u0, *to = u;
+		if (u-u0 == 1 && *u0 == '?') { from = c0; to = c; }
+		if (b + (to-from) + 1 >= buf + MAXTUPLEN) fatal("Updated tuple too long");
+		memcpy(b, from, to-from);
+		b += to-from;
+		if (*c == '\0') break;
+		*b++ = ',';
+		c++; u++;
+	}
+	*b = '\0';
+	return copyString(buf);
+}
+
+// Main ... process args, update tuples
+
+int main(int argc, char **argv)
+{
+	Reln r;  // handle on the open relation
+	Query q;  // processed version of query string
+	char err[2*MAXERRMSG];  // buffer for error messages
+	int verbose;  // show each change
+	int window;   // # changes per log sync, or 0 if not logging
+	char *rname;  // name of table/file
+	char *qstr;   // query string
+	char *ustr;   // new values
+
+	// process command-line args
+
+	int a = 1;
+	verbose = 0;  window = 0;
+	while (a < argc && argv[a][0] == '-') {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-w") == 0 && a+1 < argc) {
+			window = atoi(argv[++a]);
+			if (window < 1) fatal(USAGE);
+		}
+		else
+			fatal(USAGE);
+		a++;
+	}
+	if (argc - a < 3) fatal(USAGE);
+	rname = argv[a];  qstr = argv[a+1];  ustr = argv[a+2];
+
+	// set up relation for writing
+
+	if (!existsRelation(rname)) {
+		sprintf(err, "No such relation: %s", rname);
+		fatal(err);
+	}
+	if ((r = openRelation(rname,"r+")) == NULL) {
+		sprintf(err, "Can't open relation: %s",rname);
+		fatal(err);
+	}
+	if (window > 0 && !logRelation(r, rname, window)) {
+		sprintf(err, "Relation %s is being logged by another process", rname);
+		fatal(err);
+	}
+	// the new values have the same form as a query
+	Pred check = compilePred(r, ustr);
+	if (check == NULL) {
+		sprintf(err, "Invalid values: %s",ustr);
+		fatal(err);
+	}
+	freePred(check);
+
+	// collect the changed tuples, before any are moved
+
+	if ((q = startQuery(r, qstr)) == NULL) {
+		sprintf(err, "Invalid query: %s",qstr);
+		fatal(err);
+	}
+	int n = 0, max = 64;
+	Tuple *changed = malloc(max*sizeof(Tuple));
+	assert(changed != NULL);
+	Match m;
+	while (nextMatch(q, &m)) {
+		if (n == max) {
+			max *= 2;
+			changed = realloc(changed, max*sizeof(Tuple));
+			assert(changed != NULL);
+		}
+		changed[n] = newValues(m.tup, ustr);
+		if (pageTupleSpace(changed[n]) > pageCapacity(pagesize(r))) {
+			sprintf(err, "Updated tuple too long: %s", changed[n]);
+			fatal(err);
+		}
+		if (verbose) printf("%s -> %s\n", m.tup, changed[n]);
+		n++;
+	}
+	closeQuery(q);
+
+	// replace them
+
+	updateRelation(r, qstr, changed, n);
+	int i;
+	for (i = 0; i < n; i++) free(changed[i]);
+	free(changed);
+	if (verbose) printf("%d tuples updated\n", n);
+
+	// clean up
+
+	closeRelation(r);
+
+	return 0;
+}
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include "defs.h"
 
 void fatal(char *msg)
 {
@@ -20,3 +21,16 @@ char *copyString(char *str)
 	strcpy(new, str);
 	return new;
 }
+
+// convert e.g. "8K" or "8192" to a page size; 0 unless it is a
+//   power of 2 from MINPAGESIZE to MAXPAGESIZE
+
+int parsePageSize(char *str)
+{
+	char *end;
+	long n = strtol(str, &end, 10);
+	if (*end == 'k' || *end == 'K') { n *= 1024; end++; }
+	if (*end != '\0') return 0;
+	if (n < MINPAGESIZE || n > MAXPAGESIZE || (n & (n-1)) != 0) return 0;
+	return (int)n;
+}
@@ -9,5 +9,6 @@
 
 void fatal(char *);
 char *copyString(char *);
+int parsePageSize(char *);
 
 #endif
@@ -0,0 +1,458 @@
+// wal.c ... write-ahead log of inserts
+// part of Multi-attribute Linear-hashed Files
+// Makes inserts durable, syncing the log once per group of inserts
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "defs.h"
+#include "wal.h"
+#include "page.h"
+#include "hash.h"
+
+// A relation open for logged inserts has a log file, R.wal
+// - it starts with a WalHeader, giving the size of each page file
+//   at the last checkpoint
+// - then come records: an INSERT for each tuple, a DELETE for each
+//   delete query, an UPDATE for each update (its query, then the new
+//   tuples, so recovery redoes all of it or none), a PAGE image for
+//   each page written out of the buffer pool, and at a checkpoint, a
+//   CKPT holding the header
+// Between checkpoints the page files are left alone, except that
+//   pages are added at their ends; pages written by the buffer pool
+//   go into the log, and are read back from there
+// So after a crash the page files still hold the last checkpoint,
+//   and recovery just redoes the logged changes; splits
+//   and contractions happen again as a result, so they need no
+//   records of their own
+// A checkpoint syncs the log up to its CKPT, then copies the latest
+//   image of each page to its file; if that is interrupted, recovery
+//   finishes the copying instead of re-inserting
+// INSERTs, DELETEs and UPDATEs are synced in groups of window records
+//   (group commit), so a crash loses at most the last window-1 of them
+// Every record carries a checksum; recovery stops at the first bad
+//   one, which is where a torn write left the log
+
+#define WALMAGIC 0x4c41574d
+
+#define WAL_PAGE   4
+#define WAL_CKPT   5
+
+typedef struct {
+	Count  magic;
+	PageID npages[2];  // pages in data, ovflow files at checkpoint
+} WalHeader;
+
+typedef struct {
+	Count type;   // WAL_INSERT, ...
+	Count len;    // # bytes of contents, which follow
+	Bits  check;  // checksum of the contents
+} WalRec;
+
+// contents of a PAGE record: a PageRef, then the page
+typedef struct {
+	Count  file;  // 0 = data, 1 = ovflow
+	PageID pid;
+} PageRef;
+
+struct WalRep {
+	int    fd;        // the log file
+	char   name[MAXFILENAME];
+	int    files[2];  // data and ovflow page files
+	Divert divert;    // how their page I/O is sent here
+	Count  window;    // # INSERTs/DELETEs/UPDATEs per sync
+	Count  unsynced;  // # of them since the last sync
+	char  *buf;       // records not yet written to the log
+	size_t used;      // # bytes in buf
+	off_t  end;       // where buf goes in the log
+	off_t *where[2];  // offset in log of each page's latest image
+	Count  nwhere[2]; // # entries in each where[]
+	off_t  next;      // next record to recover
+	off_t  stop;      // end of records to recover
+	Bool   replaying; // redoing logged changes?
+	pthread_mutex_t lock;  // for all of the above
+};
+
+static Bits checksum(Count type, char *buf, Count len)
+{
+	return hash_any((unsigned char *)buf, len) ^ (type << 24) ^ len;
+}
+
+static void writeAll(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0) fatal("Can't write log");
+		p += n; len -= n; off += n;
+	}
+}
+
+static Bool readAll(int fd, void *buf, size_t len, off_t off)
+{
+	return pread(fd, buf, len, off) == (ssize_t)len;
+}
+
+static void writeBuffer(Wal w)
+{
+	writeAll(w->fd, w->buf, w->used, w->end);
+	w->end += w->used;
+	w->used = 0;
+}
+
+static void syncLog(Wal w)
+{
+	writeBuffer(w);
+	if (fdatasync(w->fd) < 0) fatal("Can't sync log");
+	w->unsynced = 0;
+}
+
+// add a record whose contents are a then b
+// returns the offset in the log of its contents
+// a record too big for the buffer (only an UPDATE can be) is written
+//   straight to the log
+
+static off_t append(Wal w, Count type, void *a, Count alen, void *b, Count blen)
+{
+	WalRec rec;
+	if (w->used + sizeof(rec) + alen + blen > WALBUF) writeBuffer(w);
+	if (sizeof(rec) + alen + blen > WALBUF) {
+		assert(blen == 0);
+		rec.type = type;
+		rec.len = alen;
+		rec.check = checksum(type, a, alen);
+		writeAll(w->fd, &rec, sizeof(rec), w->end);
+		writeAll(w->fd, a, alen, w->end + sizeof(rec));
+		off_t off = w->end + sizeof(rec);
+		w->end = off + alen;
+		return off;
+	}
+	char *c = w->buf + w->used + sizeof(rec);
+	memcpy(c, a, alen);
+	if (blen > 0) memcpy(c+alen, b, blen);
+	rec.type = type;
+	rec.len = alen + blen;
+	rec.check = checksum(type, c, rec.len);
+	memcpy(w->buf + w->used, &rec, sizeof(rec));
+	off_t off = w->end + w->used + sizeof(rec);
+	w->used += sizeof(rec) + rec.len;
+	return off;
+}
+
+static int fileOf(Wal w, int fd)
+{
+	return (fd == w->files[0]) ? 0 : 1;
+}
+
+static void setWhere(Wal w, int f, PageID pid, off_t off)
+{
+	if (pid >= w->nwhere[f]) {
+		Count n = w->nwhere[f];
+		w->nwhere[f] = (pid < 2*n) ? 2*n : pid+1;
+		w->where[f] = realloc(w->where[f], w->nwhere[f]*sizeof(off_t));
+		assert(w->where[f] != NULL);
+		memset(w->where[f]+n, 0, (w->nwhere[f]-n)*sizeof(off_t));
+	}
+	w->where[f][pid] = off;
+}
+
+static void clearWhere(Wal w)
+{
+	int f;
+	for (f = 0; f < 2; f++)
+		memset(w->where[f], 0, w->nwhere[f]*sizeof(off_t));
+}
+
+// page I/O for the page files, diverted via divertPages()
+
+static void writeImage(void *arg, int fd, PageID pid, Page p)
+{
+	Wal w = arg;
+	PageRef ref;
+	pthread_mutex_lock(&w->lock);
+	ref.file = fileOf(w, fd);
+	ref.pid = pid;
+	off_t off = append(w, WAL_PAGE, &ref, sizeof(ref), p, filePageSize(fd));
+	setWhere(w, ref.file, pid, off + sizeof(ref));
+	pthread_mutex_unlock(&w->lock);
+}
+
+static Bool readImage(void *arg, int fd, PageID pid, Page p)
+{
+	Wal w = arg;
+	int f = fileOf(w, fd);
+	Count size = filePageSize(fd);
+	pthread_mutex_lock(&w->lock);
+	off_t off = (pid < w->nwhere[f]) ? w->where[f][pid] : 0;
+	if (off != 0) {
+		if (off >= w->end)
+			memcpy(p, w->buf + (off - w->end), size);
+		else if (!readAll(w->fd, p, size, off))
+			fatal("Can't read page image from log");
+	}
+	pthread_mutex_unlock(&w->lock);
+	return (off != 0);
+}
+
+// copy the latest image of each page to its file
+
+static void copyImages(Wal w)
+{
+	int f;
+	for (f = 0; f < 2; f++) {
+		int fd = w->files[f];
+		Count size = filePageSize(fd);
+		char *page = malloc(size);
+		assert(page != NULL);
+		PageID pid;
+		for (pid = 0; pid < w->nwhere[f]; pid++) {
+			off_t off = w->where[f][pid];
+			if (off == 0) continue;
+			if (!readAll(w->fd, page, size, off))
+				fatal("Can't read page image from log");
+			writeAll(fd, page, size, (off_t)pid*size);
+		}
+		free(page);
+		if (fdatasync(fd) < 0) fatal("Can't sync page file");
+	}
+	clearWhere(w);
+}
+
+static Wal makeWal(char *name, int datafd, int ovfd, int flags)
+{
+	Wal w = malloc(sizeof(struct WalRep));
+	assert(w != NULL);
+	sprintf(w->name, "%s.wal", name);
+	w->fd = open(w->name, flags, 0644);
+	if (w->fd < 0) { free(w); return NULL; }
+	// one logging process per relation; the lock goes when it exits
+	struct flock fl;
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 1;
+	if (fcntl(w->fd, F_SETLK, &fl) < 0) {
+		close(w->fd);
+		free(w);
+		return NULL;
+	}
+	w->files[0] = datafd;
+	w->files[1] = ovfd;
+	w->divert.read = readImage;
+	w->divert.write = writeImage;
+	w->divert.arg = w;
+	w->window = 1;
+	w->unsynced = 0;
+	w->buf = malloc(WALBUF);
+	assert(w->buf != NULL);
+	w->used = 0;
+	w->end = 0;
+	w->where[0] = w->where[1] = NULL;
+	w->nwhere[0] = w->nwhere[1] = 0;
+	w->next = w->stop = 0;
+	w->replaying = FALSE;
+	pthread_mutex_init(&w->lock, NULL);
+	return w;
+}
+
+// start logging inserts to a relation's page files
+// returns NULL if some other process is already doing so
+
+Wal newWal(char *name, int datafd, int ovfd, Count window)
+{
+	Wal w = makeWal(name, datafd, ovfd, O_RDWR|O_CREAT);
+	if (w == NULL) return NULL;
+	w->window = (window < 1) ? 1 : window;
+	walReset(w);
+	divertPages(datafd, &w->divert);
+	divertPages(ovfd, &w->divert);
+	return w;
+}
+
+// open the log left by a crashed process, if there is one
+// - if it got as far as a checkpoint, finish that; *done is set, and
+//   hdr[0..n-1] gets the relation header if the log still has it
+// - otherwise, cut the page files back to the last checkpoint; the
+//   changes to redo then come from walNext()
+// returns NULL if there is no log, or its process is still running
+
+Wal recoverWal(char *name, int datafd, int ovfd, Count *hdr, Count n,
+               Bool *done)
+{
+	Wal w = makeWal(name, datafd, ovfd, O_RDWR);
+	if (w == NULL) return NULL;
+	*done = FALSE;
+	WalHeader h;
+	off_t pos = sizeof(h);
+	if (!readAll(w->fd, &h, sizeof(h), 0) || h.magic != WALMAGIC) {
+		// cut short while resetting, after a complete checkpoint
+		pos = 0;
+		*done = TRUE;
+	}
+	// find the valid records, and the latest image of each page
+	// a torn record may have any length, but not one past the end
+	off_t size = lseek(w->fd, 0, SEEK_END);
+	Count max = sizeof(PageRef) + MAXPAGESIZE + MAXTUPLEN;
+	char *c = malloc(max);
+	assert(c != NULL);
+	WalRec rec;
+	while (pos > 0 && readAll(w->fd, &rec, sizeof(rec), pos)) {
+		if (pos + sizeof(rec) + rec.len > size) break;
+		if (rec.len > max) {
+			max = rec.len;
+			c = realloc(c, max);
+			assert(c != NULL);
+		}
+		if (!readAll(w->fd, c, rec.len, pos+sizeof(rec))) break;
+		if (rec.check != checksum(rec.type, c, rec.len)) break;
+		if (rec.type == WAL_PAGE) {
+			PageRef *ref = (PageRef *)c;
+			setWhere(w, ref->file, ref->pid, pos+sizeof(rec)+sizeof(*ref));
+		}
+		else if (rec.type == WAL_CKPT) {
+			assert(rec.len == n*sizeof(Count));
+			memcpy(hdr, c, rec.len);
+			*done = TRUE;
+		}
+		pos += sizeof(rec) + rec.len;
+	}
+	free(c);
+	if (pos > 0 && ftruncate(w->fd, pos) < 0) fatal("Can't truncate log");
+	w->end = pos;
+	if (*done)
+		copyImages(w);
+	else {
+		// images are of pages changed since the checkpoint; the
+		//   changes are about to be made again
+		clearWhere(w);
+		int f;
+		for (f = 0; f < 2; f++) {
+			off_t size = (off_t)h.npages[f] * filePageSize(w->files[f]);
+			if (ftruncate(w->files[f], size) < 0)
+				fatal("Can't truncate page file");
+		}
+		w->next = sizeof(h);
+		w->stop = pos;
+		w->replaying = TRUE;
+	}
+	divertPages(datafd, &w->divert);
+	divertPages(ovfd, &w->divert);
+	return w;
+}
+
+// next change to redo during recovery, or NULL if none left
+// *type is WAL_INSERT for a tuple, WAL_DELETE for a query, or
+//   WAL_UPDATE for a query and the tuples that replace its matches,
+//   one per line
+
+char *walNext(Wal w, Count *type)
+{
+	WalRec rec;
+	while (w->next < w->stop) {
+		if (!readAll(w->fd, &rec, sizeof(rec), w->next))
+			fatal("Can't read log");
+		off_t off = w->next + sizeof(rec);
+		w->next = off + rec.len;
+		if (rec.type != WAL_INSERT && rec.type != WAL_DELETE
+		    && rec.type != WAL_UPDATE) continue;
+		char *s = malloc(rec.len+1);
+		assert(s != NULL);
+		if (!readAll(w->fd, s, rec.len, off)) fatal("Can't read log");
+		s[rec.len] = '\0';
+		*type = rec.type;
+		return s;
+	}
+	w->replaying = FALSE;
+	return NULL;
+}
+
+// log a change; a full group is synced
+
+static void logChange(Wal w, Count type, char *s, Count len)
+{
+	if (w->replaying) return;
+	pthread_mutex_lock(&w->lock);
+	append(w, type, s, len, NULL, 0);
+	if (++w->unsynced >= w->window) syncLog(w);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void walInsert(Wal w, Tuple t) { logChange(w, WAL_INSERT, t, strlen(t)); }
+void walDelete(Wal w, char *q) { logChange(w, WAL_DELETE, q, strlen(q)); }
+
+// log an update: the tuples matching q were replaced by new[0..n-1]
+
+void walUpdate(Wal w, char *q, Tuple *new, Count n)
+{
+	if (w->replaying) return;
+	size_t len = strlen(q);
+	Count i;
+	for (i = 0; i < n; i++) len += 1 + strlen(new[i]);
+	char *s = malloc(len+1), *c = s;
+	assert(s != NULL);
+	c += sprintf(c, "%s", q);
+	for (i = 0; i < n; i++) c += sprintf(c, "\n%s", new[i]);
+	logChange(w, WAL_UPDATE, s, len);
+	free(s);
+}
+
+// is it time for a checkpoint?
+// not while recovering, as the log still holds changes to redo
+
+Bool walFull(Wal w)
+{
+	pthread_mutex_lock(&w->lock);
+	Bool full = !w->replaying && w->end + w->used > WALMAX;
+	pthread_mutex_unlock(&w->lock);
+	return full;
+}
+
+// make the page files hold everything logged so far
+// the buffer pool must already have been flushed (into the log)
+// the caller saves the header itself once this returns, then resets
+
+void walCheckpoint(Wal w, Count *hdr, Count n)
+{
+	pthread_mutex_lock(&w->lock);
+	append(w, WAL_CKPT, hdr, n*sizeof(Count), NULL, 0);
+	syncLog(w);
+	copyImages(w);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// empty the log, once the page files are up to date
+
+void walReset(Wal w)
+{
+	WalHeader h;
+	int f;
+	pthread_mutex_lock(&w->lock);
+	h.magic = WALMAGIC;
+	for (f = 0; f < 2; f++) {
+		off_t size = lseek(w->files[f], 0, SEEK_END);
+		h.npages[f] = size / filePageSize(w->files[f]);
+	}
+	if (ftruncate(w->fd, 0) < 0) fatal("Can't truncate log");
+	writeAll(w->fd, &h, sizeof(h), 0);
+	if (fdatasync(w->fd) < 0) fatal("Can't sync log");
+	w->end = sizeof(h);
+	w->used = 0;
+	w->unsynced = 0;
+	clearWhere(w);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// stop logging; the relation must have been checkpointed
+
+void closeWal(Wal w)
+{
+	divertPages(w->files[0], NULL);
+	divertPages(w->files[1], NULL);
+	unlink(w->name);
+	close(w->fd);
+	pthread_mutex_destroy(&w->lock);
+	free(w->where[0]);
+	free(w->where[1]);
+	free(w->buf);
+	free(w);
+}
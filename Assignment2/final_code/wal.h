@@ -0,0 +1,32 @@
+// wal.h ... interface to write-ahead logging of changes
+// part of Multi-attribute Linear-hashed Files
+// See wal.c for details of the Wal type and functions
+
+#ifndef WAL_H
+#define WAL_H 1
+
+typedef struct WalRep *Wal;
+
+#include "defs.h"
+#include "tuple.h"
+
+#define WALBUF  (1 << 20)   // bytes of log buffered before writing
+#define WALMAX  (64 << 20)  // log size that prompts a checkpoint
+
+#define WAL_INSERT 1  // kinds of change redone by recovery
+#define WAL_DELETE 2
+#define WAL_UPDATE 3
+
+Wal newWal(char *name, int datafd, int ovfd, Count window);
+Wal recoverWal(char *name, int datafd, int ovfd, Count *hdr, Count n,
+               Bool *done);
+char *walNext(Wal, Count *type);
+void walInsert(Wal, Tuple);
+void walDelete(Wal, char *);
+void walUpdate(Wal, char *, Tuple *, Count);
+Bool walFull(Wal);
+void walCheckpoint(Wal, Count *hdr, Count n);
+void walReset(Wal);
+void closeWal(Wal);
+
+#endif